@@ -88,25 +88,71 @@ struct OMNIHeader {
     uint32_t user_table_offset; // Byte offset to user table (4 bytes)
     uint32_t max_users;         // Maximum number of users (4 bytes)
     
-    // Reserved for Phase 2: Delta Vault 
+    // Delta Vault: file versions + snapshots (0 = absent, added on load)
     uint32_t file_state_storage_offset;  // Offset to file_state_storage area (4 bytes)
     uint32_t change_log_offset;       // Offset to change log (4 bytes)
+
+    // Free-space bitmap region (0 = absent: image predates it, rebuilt on load)
+    uint64_t bitmap_offset;     // Byte offset of the bitmap (8 bytes)
+    uint64_t bitmap_size;       // Bytes used by the bitmap, a multiple of 8 (8 bytes)
+
+    // Inode table (0 = absent: directories still hold full FileEntry slots, migrated on load)
+    uint64_t inode_table_offset;  // Byte offset of inode 0's record (8 bytes)
+    uint64_t inode_bitmap_offset; // Byte offset of the inode allocation bitmap (8 bytes)
+    uint32_t inode_count;         // Records in the table (4 bytes)
+    uint32_t inode_size;          // Bytes per record (4 bytes)
+
+    // Write-ahead metadata journal at change_log_offset (0 = absent, added on load)
+    uint64_t change_log_size;     // Bytes in the journal region (8 bytes)
+
+    // Block dedup refcount table (0 = absent, added on load when dedup is on)
+    uint64_t dedup_table_offset;  // Byte offset of the DedupRecord array (8 bytes)
+    uint64_t dedup_table_size;    // Bytes in the region (8 bytes)
+
+    // Format v2: bits 32-63 of the 32-bit offsets above (0 in v1 images)
+    uint32_t user_table_offset_hi;          // (4 bytes)
+    uint32_t file_state_storage_offset_hi;  // (4 bytes)
+    uint32_t change_log_offset_hi;          // (4 bytes)
+    uint32_t user_table_blocks;             // Blocks of the user table, 0 = one (4 bytes)
     
-    uint8_t reserved[328];      // Reserved for future use (328 bytes)
+    uint8_t reserved[248];      // Reserved for future use (248 bytes)
 
     // Default constructor
     OMNIHeader() = default;
     
     // Constructor with initialization
     OMNIHeader(uint32_t version, uint64_t size, uint64_t header_sz, uint64_t block_sz)
-        : format_version(version), total_size(size), header_size(header_sz), block_size(block_sz) {
+        : format_version(version), total_size(size), header_size(header_sz), block_size(block_sz),
+          config_timestamp(0), user_table_offset(0), max_users(0), file_state_storage_offset(0),
+          change_log_offset(0), bitmap_offset(0), bitmap_size(0), inode_table_offset(0),
+          inode_bitmap_offset(0), inode_count(0), inode_size(0), change_log_size(0),
+          dedup_table_offset(0), dedup_table_size(0), user_table_offset_hi(0),
+          file_state_storage_offset_hi(0), change_log_offset_hi(0), user_table_blocks(0) {
         std::memset(magic, 0, sizeof(magic));
         std::memset(student_id, 0, sizeof(student_id));
         std::memset(submission_date, 0, sizeof(submission_date));
         std::memset(config_hash, 0, sizeof(config_hash));
         std::memset(reserved, 0, sizeof(reserved));
     }
+
+    // Full 64-bit offsets (lo + hi words)
+    uint64_t userTableOffset() const { return ((uint64_t)user_table_offset_hi << 32) | user_table_offset; }
+    uint64_t vaultOffset() const { return ((uint64_t)file_state_storage_offset_hi << 32) | file_state_storage_offset; }
+    uint64_t changeLogOffset() const { return ((uint64_t)change_log_offset_hi << 32) | change_log_offset; }
+    void setUserTableOffset(uint64_t off) {
+        user_table_offset = static_cast<uint32_t>(off);
+        user_table_offset_hi = static_cast<uint32_t>(off >> 32);
+    }
+    void setVaultOffset(uint64_t off) {
+        file_state_storage_offset = static_cast<uint32_t>(off);
+        file_state_storage_offset_hi = static_cast<uint32_t>(off >> 32);
+    }
+    void setChangeLogOffset(uint64_t off) {
+        change_log_offset = static_cast<uint32_t>(off);
+        change_log_offset_hi = static_cast<uint32_t>(off >> 32);
+    }
 };  // Total: 512 bytes
+static_assert(sizeof(OMNIHeader) == 504, "OMNIHeader layout changed (it must fit its 512-byte slot)");
 
 /**
  * User Information Structure
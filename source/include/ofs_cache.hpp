@@ -0,0 +1,96 @@
+/**
+ * @file ofs_cache.hpp
+ * @brief Buffer pool over a storage backend (block frames, CLOCK eviction, write-back)
+ * @location source/include/ofs_cache.hpp
+ */
+
+#ifndef OFS_CACHE_H
+#define OFS_CACHE_H
+
+#include "ofs_storage.hpp"
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+
+struct CacheStats {
+    uint64_t hits = 0;          // Block accesses served from a frame
+    uint64_t misses = 0;        // Frames filled (or claimed) for a block
+    uint64_t evictions = 0;     // Valid frames given to another block
+    uint64_t writebacks = 0;    // Dirty frames written to the backend
+    uint64_t bypassed = 0;      // Large transfers that went straight to the backend
+    uint64_t dirty = 0;         // Dirty frames right now
+    uint64_t frames = 0;
+};
+
+
+// ============================================================================
+// BufferPool
+// Sits between the server (and journal) and the real backend, as a backend
+// itself. The image is cached in fixed frames of one block each, found
+// through a block -> frame table. A write only dirties its frames. They reach
+// the backend when evicted or at the next flush(), sync() or datasync(),
+// which are the journal's commit points and the sendfile() handoff. CLOCK
+// picks victims: the hand clears reference bits until it finds a frame that
+// was not used since its last pass. A frame is pinned while its bytes are
+// copied outside the pool lock, and pinned frames are never evicted. Copies of
+// at most SMALL_COPY bytes (inode records, bitmap words) stay under the lock.
+//
+// Transfers spanning more than BYPASS_BLOCKS blocks (file contents, journal
+// records) go straight to the backend, after any dirty frames they overlap
+// are written back, so one large file cannot flush out the hot metadata.
+// ============================================================================
+
+class BufferPool : public StorageBackend {
+public:
+    static const uint32_t BYPASS_BLOCKS = 8;
+    static const size_t SMALL_COPY = 512;   // Copied without dropping the lock (no pin round trip)
+
+    BufferPool(std::unique_ptr<StorageBackend> backend, uint32_t frames, uint32_t block_size);
+    ~BufferPool() override;
+
+    bool open(const std::string& path) override { return inner->open(path); }
+    void read(uint64_t offset, void* buf, size_t len) override;
+    void write(uint64_t offset, const void* buf, size_t len) override;
+    void flush() override;
+    void sync() override;
+    void datasync() override;
+
+    uint64_t size() const override { return inner->size(); }
+    const char* name() const override { return inner->name(); }
+
+    CacheStats getStats();
+
+private:
+    struct Frame {
+        uint64_t block = 0;
+        uint32_t pins = 0;
+        bool valid = false;
+        bool dirty = false;
+        bool referenced = false;
+    };
+
+    std::unique_ptr<StorageBackend> inner;
+    uint32_t block_size;
+    std::vector<Frame> frames;
+    std::vector<char> memory;                   // frames.size() * block_size bytes
+    std::unordered_map<uint64_t, uint32_t> table; // Block -> frame
+    std::vector<uint32_t> free_frames;
+    uint32_t hand = 0;
+    std::mutex mtx;
+    CacheStats stats;
+
+    char* frameData(uint32_t f) { return memory.data() + (uint64_t)f * block_size; }
+    // Frame holding block, pinned; filled from the backend unless 'whole' (the
+    // caller overwrites all of it). -1 when every frame is pinned. Caller holds mtx.
+    int pinBlock(uint64_t block, bool whole);
+    void unpin(uint32_t f, bool dirtied);      // Caller holds mtx
+    int victim();                               // Caller holds mtx
+    void writeBack(uint32_t f);                 // Caller holds mtx
+    void writeBackAll();                        // Caller holds mtx
+    // Dirty frames in [first, last] are written back; 'drop' also forgets them
+    void settleRange(uint64_t first, uint64_t last, bool drop);
+};
+
+#endif // OFS_CACHE_H
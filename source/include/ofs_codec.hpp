@@ -0,0 +1,68 @@
+/**
+ * @file ofs_codec.hpp
+ * @brief Transparent file compression: a small LZ77 codec and the frame format
+ * @location source/include/ofs_codec.hpp
+ */
+
+#ifndef OFS_CODEC_H
+#define OFS_CODEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <functional>
+
+// ============================================================================
+// 1. Codec
+// Byte-oriented LZ77 in the LZ4 block style, tuned for speed over ratio:
+// sequences of (token, literals, 16-bit offset), a token holding 4 bits of
+// literal length and 4 bits of match length (minimum match 4), longer lengths
+// continued in 255-bytes. Matches are found through one hash table of 4-byte
+// prefixes, with no chains. Decoding checks every length against both buffers,
+// so a damaged frame fails instead of overrunning.
+// ============================================================================
+
+// Compressed size of src, 0 if it would not fit in cap bytes
+size_t lzCompress(const char* src, size_t len, char* dst, size_t cap);
+// False unless src decodes to exactly raw_len bytes
+bool lzDecompress(const char* src, size_t len, char* dst, size_t raw_len);
+
+
+// ============================================================================
+// 2. Frames
+// A compressed file's stored bytes are frames, each a FrameHeader and its
+// payload, cutting the content into FRAME_BYTES pieces. Frames are
+// independent, so a read decodes only the frames it overlaps. A frame that
+// does not shrink is stored as is (FRAME_RAW), and a raw frame can be read
+// partially without decoding. A frame with raw_len 0 is padding: the room a
+// patched frame left behind when it shrank.
+// ============================================================================
+
+struct FrameHeader {
+    uint32_t raw_len;           // Content bytes in this frame
+    uint32_t stored_len;        // Payload bytes that follow; FRAME_RAW set = payload is the content
+};
+
+static const uint32_t FRAME_BYTES = 64 * 1024;
+static const uint32_t FRAME_RAW = 0x80000000u;
+
+// Appends one frame holding len (<= FRAME_BYTES) bytes. False if it went in raw.
+bool appendFrame(std::string& out, const char* src, uint32_t len);
+std::string encodeFrames(const char* src, uint64_t len);
+// Appends padding frames taking exactly 'bytes' (0 or >= sizeof(FrameHeader))
+void appendPadding(std::string& out, uint64_t bytes);
+
+// Start of a frame: where a sequential reader resumes instead of walking from 0
+struct FrameCursor {
+    uint64_t raw = 0;           // Content offset
+    uint64_t at = 0;            // Stored offset of its FrameHeader
+};
+
+using StoredReader = std::function<void(uint64_t, char*, uint64_t)>;
+
+// Content bytes [offset, offset + len) of stored_size framed bytes read
+// through 'read'. False if the frames are damaged or end too early.
+bool decodeFrames(const StoredReader& read, uint64_t stored_size, uint64_t offset,
+                  char* buf, uint64_t len, FrameCursor* cursor = nullptr);
+
+#endif // OFS_CODEC_H
@@ -0,0 +1,106 @@
+/**
+ * @file ofs_dedup.hpp
+ * @brief Block deduplication: fingerprints and the refcount table (region at dedup_table_offset)
+ * @location source/include/ofs_dedup.hpp
+ */
+
+#ifndef OFS_DEDUP_H
+#define OFS_DEDUP_H
+
+#include "ofs_structures.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+// ============================================================================
+// 1. On-disk format
+// The region is an array of DedupRecords. A record says that a data block is
+// shared: 'refs' block-map entries (files and versions, across all users)
+// point at it. Blocks without a record have one owner, as before. A shared
+// block is never written in place (positioned writes copy it), so it keeps
+// its bytes until its last reference goes.
+// Block numbers are 48 bits: the high 16 bits ride in the top of the
+// fingerprint word (format v1 kept a 64-bit fingerprint there; load(true)
+// clears those bits once).
+// ============================================================================
+
+static const uint64_t FINGERPRINT_MASK = (1ULL << 48) - 1;
+
+struct DedupRecord {
+    uint32_t block_lo;          // Low 32 bits of the block, 0 with tag's top bits = free slot
+    uint32_t refs;              // Block-map entries pointing at it
+    uint64_t tag;               // Bits 0-47: blockFingerprint() of its bytes; 48-63: block bits 32-47
+
+    uint64_t block() const { return ((tag >> 48) << 32) | block_lo; }
+    uint64_t fingerprint() const { return tag & FINGERPRINT_MASK; }
+};
+
+static_assert(sizeof(DedupRecord) == 16, "DedupRecord must stay 16 bytes");
+
+// 48-bit hash of a block, four independent multiply-xor lanes over 8-byte
+// words. Only a filter: a match is confirmed by comparing the bytes.
+uint64_t blockFingerprint(const char* data, size_t len);
+
+
+// ============================================================================
+// 2. DedupTable
+// Fixed slots on disk, indexed in memory by fingerprint and by block (built
+// with one bulk read at load). Each change is one positioned write of a
+// record through the write callback (the server's journaled writeMeta).
+// Internally locked: uploads in different jails share blocks concurrently.
+// When every slot is taken, new blocks simply stay unshared.
+// ============================================================================
+
+class DedupTable {
+public:
+    using ReadFn = std::function<void(uint64_t, void*, size_t)>;
+    using WriteFn = std::function<void(uint64_t, const void*, size_t)>;
+    using SameFn = std::function<bool(uint64_t)>; // Does this block hold the bytes being stored?
+
+    DedupTable(uint64_t offset, uint32_t slots, ReadFn read, WriteFn write);
+
+    // One bulk read. from_v1: the region was written by format v1, whose
+    // fingerprints use all 64 bits; they are cut to 48 and written back.
+    void load(bool from_v1 = false);
+    // The same cut on a v1 block of records (also snapshot copies of the region)
+    static void upgradeV1(DedupRecord* recs, size_t count);
+
+    // A registered block with this fingerprint that 'same' confirms, now with
+    // one more reference; 0 if there is none
+    uint64_t share(uint64_t fingerprint, const SameFn& same);
+    // Registers a newly written block with one reference. Skipped when the
+    // fingerprint is already taken or the table is full.
+    void add(uint64_t block, uint64_t fingerprint);
+    // Drops one reference from each block of the run. Blocks left without one
+    // (or never registered) are appended to 'unreferenced'; the caller frees them.
+    void release(uint64_t start, uint64_t count, std::vector<Extent>& unreferenced);
+    bool contains(uint64_t block);  // Registered: its bytes must not change in place
+    // Removes the records of blocks 'keep' rejects (freed underneath by a reclaim)
+    uint32_t forget(const std::function<bool(uint64_t)>& keep);
+
+    uint32_t getCount();            // Shared blocks
+    uint64_t getReferences();       // Block-map entries pointing at them
+    uint32_t getCapacity() const { return slots; }
+    uint64_t slotOffset(uint32_t slot) const { return offset + (uint64_t)slot * sizeof(DedupRecord); }
+
+private:
+    uint64_t offset;
+    uint32_t slots;
+    ReadFn readAt;
+    WriteFn writeAt;
+
+    std::mutex mtx;
+    std::vector<DedupRecord> records;                    // Mirror of the slots
+    std::unordered_map<uint64_t, uint32_t> by_fingerprint; // -> slot
+    std::unordered_map<uint64_t, uint32_t> by_block;       // -> slot
+    std::vector<uint32_t> free_slots;
+    uint64_t references = 0;
+
+    void store(uint32_t slot);      // Caller holds mtx
+    void remove(uint32_t slot);     // Caller holds mtx
+};
+
+#endif // OFS_DEDUP_H
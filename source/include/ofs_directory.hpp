@@ -0,0 +1,193 @@
+/**
+ * @file ofs_directory.hpp
+ * @brief On-disk directories (name -> inode records, linear or hashed) and inode records
+ * @location source/include/ofs_directory.hpp
+ */
+
+#ifndef OFS_DIRECTORY_H
+#define OFS_DIRECTORY_H
+
+#include "odf_types.hpp"
+#include "ofs_structures.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+// ============================================================================
+// 1. Inode table
+// Everything about a file except its name, one fixed-size record per inode
+// number at header.inode_table_offset + inode * sizeof(DiskInode). A stat or
+// attribute update is a single positioned write. Inode 0 is never used and
+// inode 1 is the root directory. A tiny file keeps its bytes in the record.
+// ============================================================================
+
+struct DiskInode {
+    uint8_t type;               // EntryType
+    uint8_t pad[3];
+    uint32_t permissions;
+    uint64_t size;
+    uint64_t created_time;
+    uint64_t modified_time;
+    char owner[32];
+    uint32_t inode;
+    uint32_t parent_inode;
+    uint8_t reserved[43];       // FileEntry::reserved (block map)
+    char inline_data[128];      // PACK_INLINE: the file's bytes (ofs_tail.hpp)
+    uint8_t spare[13];
+};
+static_assert(sizeof(DiskInode) == 256, "DiskInode must stay 256 bytes");
+
+// Attribute updates write the record up to here, never the inline bytes
+static const size_t INODE_ATTR_BYTES = offsetof(DiskInode, inline_data);
+
+DiskInode toDiskInode(const FileEntry& entry);
+FileEntry fromDiskInode(std::string_view name, const DiskInode& inode);
+
+
+// ============================================================================
+// 2. Directory format
+// A directory is identified by its first block (firstBlock(), ofs_tail.hpp).
+// Entries are compact variable-length records: a DirRecord followed by the
+// name bytes, padded to 8. A block is a DirLeafHeader plus records back to
+// back. A removal leaves a hole (a record with inode 0) that a later insert
+// of a name that fits reuses; a hole at the end is given back to the block.
+//
+// Linear (every directory starts this way): the first block is one such
+// record block.
+//
+// Hashed (once that block is full, like an ext4 htree): the first block holds
+// a DirIndexHeader followed by pointers to table blocks. The table is 2^depth
+// leaf pointers, indexed by the low bits of the name hash (extendible
+// hashing). A full leaf splits in two; when its depth already equals the
+// global depth, the table doubles first. A lookup reads the header, one table
+// pointer and one leaf, whatever the directory size. Block pointers are 8
+// bytes ("\0HDIRv2"); directories hashed by format v1 ("\0HDIRv1") keep
+// 4-byte pointers, so the width is per directory.
+// ============================================================================
+
+struct DirIndexHeader {
+    char magic[8];          // "\0HDIRv2": byte 0 is 0, never the start of a linear block
+    uint32_t depth;         // Global depth: the table holds 2^depth leaf pointers
+    uint32_t entries;
+};
+
+struct DirLeafHeader {
+    uint32_t depth;         // Local depth: every name here shares its low 'depth' hash bits (0 when linear)
+    uint32_t count;         // Records in the block (holes not counted)
+    uint32_t used;          // Record bytes after this header, holes included
+    uint32_t reserved;
+};
+
+struct DirRecord {
+    uint32_t inode;         // 0 = hole
+    uint8_t type;           // EntryType, so listings need not read the inode
+    uint8_t name_len;
+    uint16_t rec_len;       // Header + name, rounded up to 8
+};
+
+
+// ============================================================================
+// 3. DirectoryStore
+// Every call goes to the image through the read/write callbacks (the server's
+// readAt/writeAt) and allocates through BlockManager. Callers serialize
+// operations on the same directory.
+//
+// lookup, store and remove work from an in-memory index of each directory
+// they have touched: the root block's header and leaf table, and per record
+// block its header, name -> record and free holes. A block is read once to
+// build its index; after that an insert or removal writes the record (and
+// the block's header) at a known offset with no reads. Growth (convert,
+// split, doubling) drops the indexes of the blocks it rewrites. Anything else
+// that rewrites directory blocks must call invalidate().
+// ============================================================================
+
+class DirectoryStore {
+public:
+    using ReadFn = std::function<void(uint64_t, void*, size_t)>;
+    using WriteFn = std::function<void(uint64_t, const void*, size_t)>;
+    using RecordFn = std::function<void(std::string_view name, uint32_t inode, EntryType type)>;
+
+    DirectoryStore(uint32_t block_size, BlockManager* block_manager, ReadFn read, WriteFn write);
+
+    // Writes an empty linear directory into block
+    void format(uint64_t dir_block);
+
+    bool lookup(uint64_t dir_block, std::string_view name, uint32_t& inode);
+    // Points name at inode, inserting it if new (converting or splitting as
+    // needed). False when no block could be allocated.
+    bool store(uint64_t dir_block, std::string_view name, uint32_t inode, EntryType type);
+    bool remove(uint64_t dir_block, std::string_view name);
+    void forEach(uint64_t dir_block, const RecordFn& fn);
+
+    // Directories written before the inode table: full FileEntry slots, in a
+    // single block or in hashed leaves. Read once by the migration.
+    void forEachLegacy(uint64_t dir_block, const std::function<void(const FileEntry&)>& fn);
+
+    // Index blocks (table + leaves) owned by a hashed directory, not dir_block itself
+    void indexBlocks(uint64_t dir_block, std::vector<uint64_t>& out);
+    void release(uint64_t dir_block);   // Frees indexBlocks()
+
+    bool isHashed(uint64_t dir_block);
+    static uint32_t hashName(std::string_view name);
+
+    void invalidate();                  // Forgets every index (the blocks were rewritten underneath)
+
+private:
+    struct RootIndex {
+        bool hashed = false;
+        DirIndexHeader hdr = {};
+        std::vector<uint64_t> table;    // 2^depth leaf pointers (hashed only)
+    };
+    struct RecordSlot {
+        uint32_t pos;                   // Offset in the block
+        uint32_t rec_len;
+        uint32_t inode;
+    };
+    struct LeafIndex {
+        DirLeafHeader hdr = {};
+        std::unordered_map<std::string, RecordSlot> names;
+        std::vector<std::pair<uint32_t, uint32_t>> holes; // (pos, rec_len), neighbours merged
+    };
+
+    uint32_t block_size;
+    BlockManager* blocks;
+    ReadFn readAt;
+    WriteFn writeAt;
+
+    // Node-based maps: an entry stays put while other directories' entries
+    // come and go, so only the map itself needs the mutex
+    std::mutex index_mtx;
+    std::unordered_map<uint64_t, RootIndex> roots;
+    std::unordered_map<uint64_t, LeafIndex> leaves;
+
+    RootIndex& rootIndex(uint64_t dir_block);
+    LeafIndex& leafIndex(uint64_t block);
+    uint64_t leafOf(const RootIndex& root, uint64_t dir_block, std::string_view name) const;
+    void forget(uint64_t block);
+
+    // Pointer width w: 8, or 4 in a v1 directory
+    static uint32_t ptrBytes(const DirIndexHeader& hdr);
+    uint32_t rootSlots(uint32_t w) const { return (block_size - sizeof(DirIndexHeader)) / w; }
+    uint32_t tableSlots(uint32_t w) const { return block_size / w; }
+    uint32_t maxDepth(uint32_t w) const;
+    void readPtrs(uint64_t offset, uint32_t n, uint32_t w, uint64_t* out);
+    void writePtrs(uint64_t offset, const uint64_t* ptrs, uint32_t n, uint32_t w);
+
+    uint64_t at(uint64_t block) const { return block * block_size; }
+    bool readHeader(uint64_t dir_block, DirIndexHeader& hdr);
+    void readTable(uint64_t dir_block, const DirIndexHeader& hdr, std::vector<uint64_t>& tables, std::vector<uint64_t>& ptrs);
+    uint64_t tableGet(uint64_t dir_block, const DirIndexHeader& hdr, uint32_t i);
+    void tableSet(uint64_t dir_block, const DirIndexHeader& hdr, uint32_t i, uint64_t leaf);
+    uint64_t allocBlock();
+
+    bool convert(uint64_t dir_block);   // Linear -> hashed (depth 0, one leaf)
+    bool doubleTable(uint64_t dir_block, DirIndexHeader& hdr);
+    bool split(uint64_t dir_block, DirIndexHeader& hdr, uint32_t hash);
+};
+
+#endif // OFS_DIRECTORY_H
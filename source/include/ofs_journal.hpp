@@ -0,0 +1,160 @@
+/**
+ * @file ofs_journal.hpp
+ * @brief Write-ahead metadata journal with group commit (region at change_log_offset)
+ * @location source/include/ofs_journal.hpp
+ */
+
+#ifndef OFS_JOURNAL_H
+#define OFS_JOURNAL_H
+
+#include "ofs_storage.hpp"
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+// ============================================================================
+// 1. On-disk format
+// The region's first block is a JournalHeader. Records follow it back to back.
+// A record is a JournalRecord, then its entries: a JournalEntry followed by
+// the new bytes for that image range, padded to 8. A record is valid only if
+// its sequence number is the next expected one and its CRC matches, so a torn
+// write at the tail is ignored on replay. There is no separate commit block.
+// ============================================================================
+
+struct JournalHeader {
+    char magic[8];          // "OFSWAL01"
+    uint64_t first_seq;     // Sequence number of the record at the start of the log
+    uint64_t reserved[6];
+};
+
+struct JournalRecord {
+    uint32_t magic;         // JOURNAL_RECORD_MAGIC
+    uint32_t entries;
+    uint64_t seq;
+    uint64_t length;        // Whole record, this header included (multiple of 8)
+    uint32_t crc;           // CRC-32 of the bytes after this header
+    uint32_t reserved;
+};
+
+struct JournalEntry {
+    uint64_t offset;        // Image byte offset
+    uint32_t length;        // New bytes that follow (then padding to 8)
+    uint32_t reserved;
+};
+
+struct JournalStats {
+    uint64_t commits = 0;       // Records written (one fdatasync each)
+    uint64_t operations = 0;    // Handles that wrote something
+    uint64_t bytes = 0;         // Record bytes logged
+    uint64_t checkpoints = 0;   // Log wrap-arounds
+};
+
+
+// ============================================================================
+// 2. Journal
+// Metadata writes join the running transaction. Each write lands in an
+// in-memory overlay of the blocks it touches, so it is visible to readers at
+// once, and it is appended to the transaction's redo entries. Nothing is
+// written in place yet. The commit thread closes the running transaction
+// once someone is waiting on it, and new handles wait until the last handle
+// of that transaction has finished. It then writes the transaction as one
+// record, calls fdatasync once for every operation in it, and applies the
+// entries to their home locations. Operations that arrive during the sync
+// accumulate in the next transaction: this is the group commit.
+//
+// The log is not circular. When a record does not fit, the image is synced
+// (every applied record is then durable in place) and the log restarts at
+// its beginning: a checkpoint.
+//
+// File data is not journaled. Its writes are direct, and the commit's
+// fdatasync makes them durable before the record that points at them
+// (ordered mode). There is one exception: a block that the log still has
+// metadata for (freed, then reused for data) goes through the journal, so a
+// replay cannot overwrite the newer data with the old metadata.
+// ============================================================================
+
+class Journal {
+public:
+    using Callback = std::function<void()>;
+
+    Journal(StorageBackend* storage, uint64_t offset, uint64_t size, uint32_t block_size);
+    ~Journal();
+
+    // Writes an empty log header at offset
+    static void format(StorageBackend* storage, uint64_t offset);
+    // Applies every committed record, then empties the log. Returns the count.
+    uint64_t replay();
+
+    void start();   // Commit thread
+    void stop();    // Commits what is pending, checkpoints, joins the thread
+
+    // A handle groups the writes of one operation. begin() waits while a
+    // transaction is closing. end() returns the sequence number to wait for,
+    // or 0 when nothing was written. Writes made outside a handle each
+    // join the current transaction on their own.
+    void begin();
+    uint64_t end();
+
+    void write(uint64_t offset, const void* buf, size_t len);     // Metadata
+    void writeData(uint64_t offset, const void* buf, size_t len); // File contents
+    void read(uint64_t offset, void* buf, size_t len);            // Sees writes not applied yet
+    bool pending(uint64_t offset, uint64_t len);                 // Some block of the range is not in place yet
+
+    // Runs fn once transaction seq is durable (at once if it already is)
+    void afterCommit(uint64_t seq, Callback fn);
+
+    JournalStats getStats();
+    uint64_t getUsedBytes();
+    uint64_t getCapacity() const { return capacity; }
+
+private:
+    struct Transaction {
+        uint64_t seq = 0;
+        int active = 0;                 // Handles still inside
+        uint32_t entries = 0;
+        uint64_t operations = 0;
+        std::vector<char> body;         // Serialized JournalEntry + bytes
+        std::unordered_set<uint64_t> blocks;
+    };
+    struct Pending {
+        std::vector<char> data;         // Block with every unapplied write
+        uint64_t seq;                   // Last transaction that wrote it
+    };
+
+    StorageBackend* storage;
+    uint64_t region;                    // Byte offset of the JournalHeader
+    uint64_t capacity;                  // Bytes available to records
+    uint32_t block_size;
+
+    std::mutex mtx;
+    std::condition_variable handle_cv;  // begin() waiting for a closing transaction
+    std::condition_variable commit_cv;  // Wakes the commit thread
+    Transaction running;
+    bool closing = false;               // 'running' is draining before its commit
+    bool commit_wanted = false;
+    bool stopping = false;
+    uint64_t committed = 0;             // Highest durable sequence
+    std::atomic<uint64_t> head{0};      // Next record position (relative to the first record), read without the lock
+    std::unordered_map<uint64_t, Pending> overlay;   // Block -> unapplied contents
+    std::unordered_set<uint64_t> logged;             // Blocks with records in the log
+    std::atomic<size_t> overlay_blocks;              // overlay.size(), read without the lock
+    std::map<uint64_t, std::vector<Callback>> waiting; // By sequence
+    JournalStats stats;
+    std::thread committer;
+
+    uint64_t recordsAt() const { return region + block_size; }
+    void record(uint64_t offset, const void* buf, size_t len); // Caller holds mtx
+    void commitLoop();
+    void commit(Transaction& txn);      // Outside mtx
+    void writeHeader(uint64_t first_seq);
+    void applyEntries(const char* body, uint64_t len, uint32_t entries);
+};
+
+#endif // OFS_JOURNAL_H
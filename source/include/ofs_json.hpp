@@ -0,0 +1,128 @@
+/**
+ * @file ofs_json.hpp
+ * @brief Single-pass JSON request parser and reusable response writer
+ * @location source/include/ofs_json.hpp
+ */
+
+#ifndef OFS_JSON_H
+#define OFS_JSON_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <deque>
+
+// ============================================================================
+// 1. Request Parser
+// One tokenizer pass over the payload records every key/value as views into
+// the original bytes. Keys of nested objects ("parameters": {...}) are
+// flattened and the first occurrence wins, the same lookup rule the old
+// getJsonValue() had. Nothing is allocated unless a string value contains
+// escapes and is read with getString().
+// ============================================================================
+
+class JsonRequest {
+public:
+    static const int MAX_FIELDS = 32;
+
+    // Parses the first top-level object in payload. The payload must outlive
+    // this object. Returns false on malformed input.
+    bool parse(std::string_view payload);
+
+    // Raw value: string contents without quotes (still escaped), or the literal
+    // token for numbers/true/false/null, or the whole text of an array/object
+    std::string_view raw(std::string_view key) const;
+    bool has(std::string_view key) const;
+
+    // Unescaped value ("" if missing), valid as long as this object and the
+    // payload. A view into the payload unless the value has escapes; those are
+    // decoded once into storage owned by this object.
+    std::string_view getString(std::string_view key) const;
+    int64_t getInt(std::string_view key, int64_t fallback = 0) const;
+    bool getBool(std::string_view key, bool fallback = false) const;
+
+    // Offset just past the closing brace of the top-level object. Bytes after
+    // it in the same message are a binary attachment.
+    size_t end() const { return end_offset; }
+
+private:
+    struct Field {
+        std::string_view key;
+        std::string_view value;
+        bool is_string;
+        bool has_escapes;
+    };
+
+    Field fields[MAX_FIELDS];
+    int field_count = 0;
+    size_t end_offset = 0;
+    mutable std::deque<std::string> decoded; // Escaped values read so far (deque: views stay valid)
+
+    const Field* find(std::string_view key) const;
+
+    friend class JsonParser;  // The tokenizer in ofs_json.cpp fills 'fields'
+};
+
+// Where jsonObjectEnd() stopped, so a request arriving in pieces is scanned once
+struct JsonScan {
+    size_t pos = 0;
+    int depth = 0;
+    bool in_string = false;
+    bool escape = false;    // The previous byte was a backslash inside a string
+};
+
+// Index one past the closing brace of the first complete top-level object in
+// buf, or npos if it has not fully arrived yet (used by the event loop).
+// Resumes at scan.pos; reset scan once the object is consumed.
+size_t jsonObjectEnd(std::string_view buf, JsonScan& scan);
+
+// Decodes JSON string escapes (\n, \", \uXXXX incl. surrogate pairs) to UTF-8
+std::string jsonUnescape(std::string_view raw);
+
+
+// ============================================================================
+// 2. Response Writer
+// Appends straight into one caller-owned buffer (reserved once and reused by
+// each worker), inserting commas automatically and escaping every string.
+// Valid UTF-8 passes through; any other byte goes out as \u00XX (its Latin-1
+// reading), so the output is always valid JSON for a strict decoder.
+// ============================================================================
+
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out);
+
+    JsonWriter& beginObject();
+    JsonWriter& endObject();
+    JsonWriter& beginArray();
+    JsonWriter& endArray();
+    JsonWriter& key(std::string_view k);
+
+    JsonWriter& value(std::string_view v);
+    JsonWriter& value(const char* v) { return value(std::string_view(v)); }
+    JsonWriter& value(const std::string& v) { return value(std::string_view(v)); }
+    JsonWriter& value(uint64_t v);
+    JsonWriter& value(int64_t v);
+    JsonWriter& value(uint32_t v) { return value(static_cast<uint64_t>(v)); }
+    JsonWriter& value(int v) { return value(static_cast<int64_t>(v)); }
+    JsonWriter& value(double v);
+    JsonWriter& value(bool v);
+
+    // key + value in one call
+    template <typename T>
+    JsonWriter& field(std::string_view k, const T& v) { key(k); return value(v); }
+
+private:
+    static const int MAX_DEPTH = 16;
+
+    std::string& buf;
+    bool first[MAX_DEPTH];  // Per nesting level: no comma needed before the next item
+    int depth;
+    bool after_key;
+
+    void separator();
+    void escape(std::string_view v);
+};
+
+#endif // OFS_JSON_H
@@ -9,46 +9,393 @@
 
 #include "odf_types.hpp"      // Use the official types
 #include "ofs_structures.hpp"   // Use our custom AVL/N-ary trees
+#include "ofs_storage.hpp"      // .omni image access (mmap / fstream)
+#include "ofs_cache.hpp"        // Buffer pool in front of the backend
+#include "ofs_directory.hpp"    // On-disk directory blocks (linear / hashed)
+#include "ofs_journal.hpp"      // Write-ahead metadata journal
+#include "ofs_vault.hpp"        // File versions + snapshots
+#include "ofs_tail.hpp"         // Inline files + shared tail blocks
+#include "ofs_codec.hpp"        // Compressed file frames
+#include "ofs_dedup.hpp"        // Shared data blocks + refcounts
+#include "ofs_json.hpp"         // Request scanning + JSON writer
 #include <queue>
 #include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <atomic>
 #include <string>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <chrono>
+#include <functional>
 
 // Structure for a queued client request
 struct ClientRequest {
     int client_socket;
+    uint64_t connection_id;     // Guards against fd reuse after a client disconnects
     std::string json_payload;
+    std::chrono::steady_clock::time_point enqueued_at;
+    std::chrono::steady_clock::time_point deadline; // Dropped unstarted after this (queue_timeout)
+};
+
+// Request-queue counters, reported by get_stats
+struct QueueStats {
+    std::atomic<uint64_t> depth{0};         // Requests waiting right now
+    std::atomic<uint64_t> peak_depth{0};
+    std::atomic<uint64_t> enqueued{0};
+    std::atomic<uint64_t> rejected{0};      // One-shot requests turned away while full
+    std::atomic<uint64_t> deferred{0};      // Framed requests held back until a slot freed
+    std::atomic<uint64_t> expired{0};       // Past their deadline when a worker got to them
+    std::atomic<uint64_t> total_wait_us{0}; // Summed enqueue -> dequeue time
+    std::atomic<uint64_t> max_wait_us{0};
+};
+
+// Compression counters, reported by get_stats
+struct CodecStats {
+    std::atomic<uint64_t> files{0};         // Files stored compressed
+    std::atomic<uint64_t> raw_bytes{0};     // Their content bytes
+    std::atomic<uint64_t> stored_bytes{0};  // Their frame bytes
+    std::atomic<uint64_t> raw_frames{0};    // Frames kept as is (did not shrink)
+    std::atomic<uint64_t> compress_us{0};
+    std::atomic<uint64_t> decoded_bytes{0}; // Content bytes read back through frames
+    std::atomic<uint64_t> decompress_us{0};
+};
+
+// Deduplication counters, reported by get_stats
+struct DedupStats {
+    std::atomic<uint64_t> checked{0};       // Whole blocks fingerprinted on the way in
+    std::atomic<uint64_t> duplicates{0};    // Of those, stored as a reference to an existing block
+    std::atomic<uint64_t> ingest_us{0};     // Time spent fingerprinting and matching
+};
+
+// Content of a compressed file decoded while it is sent, one window at a time.
+// The stored bytes are the extents (pinned until sent) and a copy of the packed ones.
+struct FrameSource {
+    std::vector<Extent> extents;
+    uint64_t block_bytes = 0;
+    std::string packed;
+    uint64_t stored = 0;
+    uint64_t offset = 0;        // Content offset of the next window
+    uint64_t end = 0;           // Content offset the segment ends at
+    FrameCursor cursor;         // Frame the last window ended in
+    std::string window;         // Decoded bytes, sent from window_pos on
+    size_t window_pos = 0;
+};
+
+// A byte range of the .omni image sent to a socket with sendfile(), no user-space copy
+struct FileSegment {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::string bytes;          // Non-empty: sent as is instead of the image range (nothing pinned)
+    std::shared_ptr<FrameSource> frames; // Set: 'length' bytes decoded from these frames instead
+};
+
+// Where a file's bytes are: whole blocks, then (for a packed file) the rest
+// inline in its inode record or in a fragment of a shared tail block
+struct FileLayout {
+    std::vector<Extent> extents;
+    uint64_t block_bytes = 0;   // File bytes the extents hold
+    uint64_t packed_at = 0;     // Image offset of the bytes after them
+    bool packed_inline = false; // They are in the inode record (rewritten in place, journaled)
+    uint64_t stored_size = 0;   // Bytes held: the file size, or its frames' when compressed
+    bool framed = false;        // PACK_COMPRESSED
+};
+
+// What a positioned write (file_write) did with the blocks it covered
+struct RangeWrite {
+    uint64_t in_place = 0;      // Overwritten where they were
+    uint64_t copied = 0;        // Shared or frozen: written to a copy instead
+    uint64_t added = 0;         // Growth past the old whole blocks
+    bool extended = false;      // The growth continued the last run
+};
+
+// A positioned write as the stored bytes it changes (see patchStored)
+struct StoredPatch {
+    uint64_t size = 0;          // New content size
+    uint64_t stored = 0;        // New stored size: size, or the frames' when framed
+    bool framed = false;
+    uint64_t dirty_from = 0;    // Stored bytes [dirty_from, dirty_to) change
+    uint64_t dirty_to = 0;
+    uint64_t insert_at = 0;     // Fresh blocks put in before old block insert_at,
+    uint64_t inserted = 0;      // moving the ones from there on up without rewriting them
+    std::function<void(uint64_t, char*, uint64_t)> compose; // New stored bytes; zeros past 'stored'
+};
+
+// Structure for a finished response waiting to be written by the event loop
+struct ClientResponse {
+    int client_socket;
+    uint64_t connection_id;
+    std::string payload;
+    std::vector<FileSegment> attachment; // Raw bytes sent right after payload (blocks stay pinned until sent)
+    uint64_t commit_seq = 0;    // Journal transaction to wait for before replying (0 = nothing written)
+};
+
+// One queued piece of socket output: either owned bytes or a pinned .omni range
+struct OutChunk {
+    std::string bytes;
+    FileSegment file;           // length 0 => this is a byte chunk
+    uint64_t pos = 0;           // Bytes of this chunk already sent
+};
+
+// Wire protocol spoken on a socket, decided by its first byte
+enum class ConnectionMode {
+    UNKNOWN,    // Nothing received yet
+    ONE_SHOT,   // Legacy: one bare JSON object, one response, then close
+    FRAMED      // Persistent: [4-byte big-endian length][JSON] frames, pipelined
+};
+
+// Per-socket state owned by the epoll event loop
+struct Connection {
+    uint64_t id;
+    ConnectionMode mode = ConnectionMode::UNKNOWN;
+    std::string in_buf;         // Bytes received but not yet handed to the queue
+    size_t in_pos = 0;          // Start of the first unconsumed byte in in_buf
+    JsonScan scan;              // One-shot: how far in_buf has been searched for the request's end
+    std::deque<OutChunk> out_queue; // Output waiting for the socket to become writable
+    bool in_flight = false;     // A request from this socket is queued / being processed
+    bool deferred = false;      // Waiting in deferred_clients for a free queue slot
+    bool read_paused = false;   // Framed: in_buf is full; unread bytes wait in the kernel
+    bool close_after_write = false;
+};
+
+// An open chunked transfer (file_write_* / file_read_*). It lives until it is
+// finished, aborted, or the connection that opened it closes.
+struct FileStream {
+    uint64_t id;
+    uint64_t connection_id;
+    std::string session_id;
+    std::string r_path;         // Translated target path
+    bool is_write;
+    std::vector<Extent> extents; // Write: staged blocks (owned). Read: the file's blocks (pinned)
+    uint64_t block_count = 0;   // Total blocks in extents
+    uint64_t block_bytes = 0;   // Read: file bytes in extents
+    std::string packed;         // Read: the bytes after them (inline/tail), copied at file_read_begin
+    uint64_t size = 0;          // Write: bytes received. Read: file size
+    uint64_t stored = 0;        // Bytes in extents + packed: size, or less when framed
+    uint64_t position = 0;      // Read: next byte to send
+    bool compress = false;      // Write: build frames as bytes arrive
+    bool framed = false;        // Stored bytes are frames (ofs_codec.hpp)
+    std::string pending;        // Write: content not yet in a frame (under FRAME_BYTES)
+    FrameCursor cursor;         // Read: frame the last chunk ended in
+    std::mutex mtx;             // Held while a worker (or abort) touches the stream
+    bool closed = false;
 };
 
 class OFSServer {
 private:
     // -- Components --
     std::string omni_file_path;
-    std::fstream file_stream;   // The actual .omni file handle
+    std::unique_ptr<StorageBackend> storage; // The .omni image (mmap, or fstream fallback)
+    std::string storage_backend;             // [filesystem] storage_backend
+    BufferPool* cache;                       // The pool inside 'storage' (null when cache_frames = 0)
+    uint32_t cache_frames;                   // [filesystem] cache_frames: one block each
+    AllocPolicy alloc_policy;                // [filesystem] alloc_policy
+    int omni_fd;                // Read-only descriptor of the same file, source for sendfile()
     
     // -- In-Memory Data Structures --
     OMNIHeader header;
     UserAVLTree userTree;       // DSA: AVL Tree
+    SlotMap user_slots;         // User table: slots in use, username -> slot
     FileSystemTree fileTree;    // DSA: N-ary Tree
     BlockManager* blockManager; // DSA: Bitmap
+    BlockManager* inodeMap;     // DSA: Bitmap, one bit per inode-table record
+    std::unique_ptr<DirectoryStore> dirs; // DSA: Extendible hashing (on disk)
+    std::unique_ptr<Journal> journal;     // Metadata WAL at change_log_offset (null while loading)
+    uint32_t journal_blocks;              // [filesystem] journal_blocks: size of a new journal region
+    VaultHeader vault;                    // Delta Vault region at file_state_storage_offset
+    std::unique_ptr<VersionTable> versions; // Old block maps of overwritten files (null without a vault)
+    uint32_t max_versions;                // [filesystem] max_versions: old versions kept per file (0 = none)
+    uint32_t vault_blocks;                // [filesystem] vault_blocks: version-table size of a new vault
+    std::unique_ptr<TailStore> tails;     // Shared blocks holding the last bytes of small files
+    bool tail_packing;                    // [filesystem] tail_packing: inline tiny files, pack short tails
+    bool compression;                     // [filesystem] compression = lz: new files stored as frames
+    CodecStats codec_stats;
+    std::unique_ptr<DedupTable> dedup_table; // Refcounts of shared data blocks (null without the region)
+    bool dedup;                           // [filesystem] dedup: new whole blocks matched against the table
+    uint32_t dedup_blocks;                // [filesystem] dedup_blocks: size of a new table region
+    DedupStats dedup_stats;
+    uint64_t image_size;                  // [filesystem] total_size: bytes of a new image (created sparse)
+    uint64_t image_block_size;            // [filesystem] block_size of a new image (an existing one keeps its header's)
+    uint64_t image_max_files;             // [filesystem] max_files: inode records of a new table (0 = one per 16 KB)
+    uint64_t image_max_users;             // [security] max_users: user table slots of a new image
+    bool fresh_image;                     // Formatting a new image: untouched regions already read as zeros
 
     // -- Networking & Queue --
     int server_socket;
     int port;
-    bool is_running;
+    std::atomic<bool> is_running;
+    int max_connections;
+
+    // epoll event loop (only touched by the thread inside run())
+    int epoll_fd;
+    int wake_fd;                // eventfd: workers poke it when a response is ready
+    uint64_t next_connection_id;
+    std::unordered_map<int, Connection> connections;
     
     // FIFO Queue components
     std::queue<ClientRequest> requestQueue;
     std::mutex queue_mutex;     // Thread safety for the queue
+    std::condition_variable queue_cv; // Wakes idle workers when a request arrives
+    size_t queue_capacity;      // Bound on requestQueue (0 in config = max_connections)
+    int queue_timeout;          // Seconds a request may wait before it is dropped
+    QueueStats queue_stats;
+    std::deque<int> deferred_clients; // Framed sockets with a request parked until the queue drains
+
+    // Worker pool
+    int worker_threads;
+    std::vector<std::thread> workers;
+
+    // -- Locking (see processRequest) --
+    // namespace_lock: shared by operations confined to one /home/{user} jail,
+    // exclusive for anything touching /, /home itself, the user table or several jails.
+    std::shared_mutex namespace_lock;
+    std::map<std::string, std::unique_ptr<std::mutex>> jail_locks; // One mutex per /home/{user}
+    std::mutex jail_locks_mutex;  // Guards the jail_locks map itself
+    std::mutex sessions_mutex;    // Guards active_sessions
+
+    // Open chunked transfers, keyed by stream_id
+    std::unordered_map<uint64_t, std::shared_ptr<FileStream>> streams;
+    std::mutex streams_mutex;     // Guards streams and next_stream_id
+    uint64_t next_stream_id;
+
+    // Background prefetcher: reads directory stubs ahead of the first request
+    // that needs them (prefetch_paths at startup, a user's home at login)
+    std::vector<std::string> prefetch_paths; // [filesystem] prefetch_paths
+    int prefetch_depth;                      // [filesystem] prefetch_depth: levels below each path
+    std::deque<std::pair<std::string, int>> prefetch_queue; // (path, levels left)
+    std::mutex prefetch_mutex;
+    std::condition_variable prefetch_cv;
+    std::thread prefetcher;
+
+    // Finished responses travelling back from the worker to the event loop
+    std::queue<ClientResponse> responseQueue;
+    std::mutex response_mutex;
 
     // -- Internal Helpers --
-    void processRequest(ClientRequest req); // The "Core Logic"
-    void loadFileSystem();      // fs_init: Reads disk -> populates Trees
+    void processRequest(const ClientRequest& req, ClientResponse& resp); // The "Core Logic": fills resp.payload (+ attachment)
+    bool openStorage();         // storage_backend, falling back to fstream
+    void attachCache(uint32_t block_size); // Wraps the backend in the buffer pool
+    OFSErrorCodes loadFileSystem(); // fs_init: Reads disk -> populates Trees (upgrading a v1 image)
+    void attachBitmap();        // Write-through of BlockManager changes to the bitmap region
+    void markDirectoryBlocks(uint64_t dir_block, int depth); // Legacy images: rebuild usage from the tree
+    bool createInodeTable();    // Allocates the table + its bitmap and records them in the header
+    void attachInodes();        // Write-through of inodeMap changes to the inode bitmap
+    void migrateDirectory(uint64_t dir_block, uint32_t dir_inode, int depth); // FileEntry slots -> records + inodes
+    bool createJournal();       // Allocates the journal region and records it in the header
+    void openJournal();         // Replays it and starts the commit thread
+    bool createVault();         // Allocates the Delta Vault region and records it in the header
+    void openVault();           // Version index + the blocks snapshots hold
+    bool createDedupTable();    // Allocates the refcount table region and records it in the header
+    void openDedupTable(bool from_v1 = false); // from_v1: rewrites the v1 fingerprints (and snapshot copies) once
+    void loadUsers();           // User table -> AVL tree + slot map
+    void loadRoot();            // Root as an unloaded stub
     void saveFileSystem();      // Writes Trees -> disk
     
     // Parsing the config file
     void loadConfig(std::string config_path);
+
+    // Positioned .omni I/O (thread-safe, forwarded to storage)
+    void readAt(uint64_t offset, void* buf, size_t len);
+    void writeAt(uint64_t offset, const void* buf, size_t len);   // File contents
+    void writeMeta(uint64_t offset, const void* buf, size_t len); // Everything else: journaled
+    void flushDisk();           // Visible to sendfile()
+    void syncDisk();            // Durable
+
+    // Locking helpers
+    std::mutex& jailMutex(const std::string& username);
+    std::string sessionUser(const std::string& session_id);
+
+    // Chunked transfer helpers
+    std::shared_ptr<FileStream> openStream(uint64_t connection_id, const std::string& sid,
+                                           const std::string& r_path, bool is_write);
+    std::shared_ptr<FileStream> findStream(uint64_t id, const std::string& sid);
+    void closeStream(FileStream& stream);           // Caller holds stream.mtx
+    void abortStreams(uint64_t connection_id);
+    bool growStream(FileStream& stream, uint64_t new_size);
+    // Directory entries + inode table
+    std::vector<FileEntry> readDirectory(uint64_t dir_block);
+    FileEntry readInode(uint32_t inode, std::string_view name);
+    void writeInode(const FileEntry& entry);    // Attribute update: one positioned write
+    uint32_t allocInode();                      // 0 when the table is full
+    void freeInode(uint32_t inode);
+    bool storeEntry(FSNode* parent, const FileEntry& entry); // Inode record + name in parent (if new)
+    void unstoreEntry(FSNode* parent, const FileEntry& entry); // Name out of parent, inode freed
+    void attachDirectories();   // DirectoryStore and TailStore over readAt/writeMeta
+    std::vector<FileEntry> loadChildren(const FileEntry& dir); // FileSystemTree loader
+    void countInodes(int& files, int& dirs, int& fragmented);  // Scan of the inode table
+
+    // Prefetch helpers
+    void prefetch(const std::string& path, int depth);
+    void prefetchLoop();
+
+    // File block maps (ofs_tail.hpp): first block, extent map (0 = one run),
+    // PackedRef (inline / tail)
+    std::vector<Extent> fileExtents(const FileEntry& entry, std::vector<uint64_t>* map_blocks = nullptr);
+    bool setFileExtents(FileEntry& entry, const std::vector<Extent>& extents); // Writes map blocks if fragmented
+    void freeFileBlocks(const FileEntry& entry);
+    void releaseBlocks(uint64_t start, uint64_t count); // Data blocks: shared ones only lose a reference
+    std::vector<Extent> shareBlocks(const std::vector<Extent>& extents, uint64_t bytes, const char* data);
+    std::vector<FileSegment> fileSegments(const std::vector<Extent>& extents, uint64_t offset, uint64_t len);
+    void readFile(const std::vector<Extent>& extents, uint64_t offset, char* buf, uint64_t len);
+    void writeFile(const std::vector<Extent>& extents, uint64_t offset, const char* buf, uint64_t len);
+
+    // Packed files (ofs_tail.hpp)
+    uint64_t wholeBlocks(const FileEntry& entry);
+    uint64_t planLayout(uint64_t size, uint8_t& flags); // Whole blocks a new content of 'size' bytes gets
+    bool packTail(FileEntry& entry, uint8_t flags);    // Sets reserved[8..15], claiming a fragment for PACK_TAIL
+    FileLayout fileLayout(const FileEntry& entry);
+    uint64_t inlineOffset(uint32_t inode) const;
+    void readContent(const FileLayout& layout, uint64_t offset, char* buf, uint64_t len);
+    void writePacked(const FileLayout& layout, const char* buf, uint64_t len); // The bytes after the whole blocks
+    uint64_t storedSize(const FileEntry& entry); // size, or reserved[16..23] when compressed
+    bool readData(const FileLayout& layout, uint64_t offset, char* buf, uint64_t len); // Content bytes (decoded)
+    FileSegment frameSegment(const std::vector<Extent>& extents, uint64_t block_bytes, std::string packed,
+                             uint64_t stored, uint64_t offset, uint64_t len, const FrameCursor& cursor);
+    bool nextWindow(FrameSource& src);  // Decodes the next window (event loop, or the first one in a worker)
+    bool stageChunk(FileStream& stream, std::string_view chunk);        // Received bytes, framed or not
+    bool stageBytes(FileStream& stream, const char* buf, uint64_t len); // Appends to the staged blocks
+    bool stageFrames(FileStream& stream, bool last);  // Frames out of pending (all of it when last)
+    void attachContent(ClientResponse& resp, const std::vector<Extent>& extents, uint64_t block_bytes,
+                       const std::string& packed, uint64_t offset, uint64_t len);
+
+    // Positioned writes: only the blocks a range covers change
+    bool ownsBlock(uint64_t block);  // Nothing but the current file can see it
+    OFSErrorCodes writeRange(FileEntry& entry, uint64_t offset, std::string_view data, RangeWrite& out, std::string& error);
+    OFSErrorCodes patchFrames(FileEntry& entry, uint64_t offset, std::string_view data, RangeWrite& out, std::string& error);
+    OFSErrorCodes patchStored(FileEntry& entry, const StoredPatch& patch, RangeWrite& out, std::string& error);
+
+    // Delta Vault: versions are old block maps, snapshots are copies of the metadata blocks
+    void keepVersion(const FileEntry& old);  // Archives a replaced block map (or frees it)
+    void dropVersions(const std::vector<VersionRecord>& recs); // Frees their blocks
+    FileEntry versionEntry(const VersionRecord& rec);
+    uint64_t snapshotOffset(uint32_t slot) const;
+    std::vector<SnapshotRecord> readSnapshots();
+    std::vector<SnapshotBlock> readManifest(uint64_t first_block);
+    std::vector<uint64_t> metadataBlocks();  // What a snapshot copies
+    std::vector<uint64_t> liveBlocks();      // Mark pass: every block something refers to
+    void updateHeld();                       // Union of the snapshots' bitmaps -> blockManager
+    void reclaimBlocks();                    // Frees used blocks that are neither live nor held
+    bool createSnapshot(const std::string& name, SnapshotRecord& rec, std::string& error);
+    bool restoreSnapshot(const std::string& name, uint64_t& rewritten, std::string& error);
+    bool deleteSnapshot(const std::string& name, std::string& error);
+
+    // Event loop helpers
+    void acceptClients();
+    void readClient(int fd);
+    void dispatchClient(int fd);
+    void flushClient(int fd);
+    void closeClient(int fd);
+    void drainResponses();
+    void queueBytes(Connection& conn, const std::string& bytes);
+    void pinSegment(const FileSegment& seg);
+    void releaseSegment(const FileSegment& seg);
+    void enqueueRequest(int fd, Connection& conn, std::string payload);
+    void postResponse(ClientResponse resp);
     
     std::map<std::string, std::string> active_sessions; // Maps session_id -> username
     
@@ -61,9 +408,9 @@ public:
 
     // Lifecycle
     OFSErrorCodes init(std::string config_path); // Opens file, loads AVL/N-ary trees
-    void run();      // Main loop: Accepts clients -> pushes to Queue
+    void run();      // Event loop: epoll accepts/reads/writes -> pushes to Queue
     void worker();   // Worker loop: Pops from Queue -> processRequest()
-    void shutdown();
+    void shutdown(); // Asks run() to stop; safe to call from a signal handler
 };
 
-#endif // OFS_SERVER_H
\ No newline at end of file
+#endif // OFS_SERVER_H
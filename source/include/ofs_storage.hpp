@@ -0,0 +1,103 @@
+/**
+ * @file ofs_storage.hpp
+ * @brief Storage backends for the .omni image (mmap and std::fstream)
+ * @location source/include/ofs_storage.hpp
+ */
+
+#ifndef OFS_STORAGE_H
+#define OFS_STORAGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <memory>
+
+// ============================================================================
+// 1. Interface
+// All positioned I/O on the image goes through one of these. Callers own the
+// consistency of overlapping ranges (the server's filesystem locks); a backend
+// only has to keep its own state safe.
+// ============================================================================
+
+class StorageBackend {
+public:
+    virtual ~StorageBackend() = default;
+
+    virtual bool open(const std::string& path) = 0;
+    virtual void read(uint64_t offset, void* buf, size_t len) = 0;
+    virtual void write(uint64_t offset, const void* buf, size_t len) = 0;
+
+    // Makes writes visible to other descriptors of the file (e.g. sendfile)
+    virtual void flush() = 0;
+    // Durability point: returns once written data has reached the device
+    virtual void sync() = 0;
+    // Same for file contents only (fdatasync): the journal's commit point
+    virtual void datasync() = 0;
+
+    virtual uint64_t size() const = 0;
+    virtual const char* name() const = 0;
+};
+
+// "mmap" (default) or "fstream". Returns nullptr for an unknown name.
+std::unique_ptr<StorageBackend> makeStorageBackend(const std::string& kind);
+
+
+// ============================================================================
+// 2. Memory-mapped backend
+// The whole image is mapped MAP_SHARED. Reads and writes are memcpy() against
+// the mapping, so there is no syscall and no shared cursor: workers touching
+// different ranges never wait on each other. The mapping is the page cache,
+// so flush() has nothing to do; sync() is msync(MS_SYNC).
+// ============================================================================
+
+class MmapBackend : public StorageBackend {
+public:
+    ~MmapBackend() override;
+
+    bool open(const std::string& path) override;
+    void read(uint64_t offset, void* buf, size_t len) override;
+    void write(uint64_t offset, const void* buf, size_t len) override;
+    void flush() override {}
+    void sync() override;
+    void datasync() override;
+
+    uint64_t size() const override { return length; }
+    const char* name() const override { return "mmap"; }
+
+private:
+    int fd = -1;
+    char* base = nullptr;
+    uint64_t length = 0;
+};
+
+
+// ============================================================================
+// 3. fstream backend (fallback)
+// The original implementation: one std::fstream, so every access is a
+// seek + read/write pair under a mutex.
+// ============================================================================
+
+class FstreamBackend : public StorageBackend {
+public:
+    ~FstreamBackend() override;
+
+    bool open(const std::string& path) override;
+    void read(uint64_t offset, void* buf, size_t len) override;
+    void write(uint64_t offset, const void* buf, size_t len) override;
+    void flush() override;
+    void sync() override;
+    void datasync() override;
+
+    uint64_t size() const override { return length; }
+    const char* name() const override { return "fstream"; }
+
+private:
+    std::fstream stream;
+    std::mutex mtx;      // The stream has a single cursor
+    int sync_fd = -1;    // fsync() target; std::fstream does not expose its descriptor
+    uint64_t length = 0;
+};
+
+#endif // OFS_STORAGE_H
@@ -1,6 +1,6 @@
 /**
  * @file ofs_structures.h
- * @brief In-Memory Data Structures (AVL Tree, N-ary Tree, Bitmap)
+ * @brief In-Memory Data Structures (AVL Tree, N-ary Tree, Bitmap, Slot Map)
  * @location source/include/ofs_structures.h
  */
 
@@ -12,6 +12,12 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <functional>
 
 // ============================================================================
 // 1. AVL Tree (For User Management)
@@ -52,30 +58,43 @@ public:
     void insert(UserInfo info);
     UserInfo* search(std::string username); // Returns pointer to data or nullptr
     std::vector<UserInfo> getAllUsers();    // Returns sorted list for Admin
+    void clear();                           // Drops every user (snapshot restore reloads the table)
 };
 
 
 // ============================================================================
 // 2. N-ary Tree (For Directory Structure)
 // Uses 'FileEntry' from ofs_types.hpp
+// Directories read from disk start as unloaded stubs: their children are
+// fetched through the loader the first time anything looks inside them.
 // ============================================================================
 
 struct FSNode {
     FileEntry metadata;            // The official FileEntry struct
     FSNode* parent;                // Pointer to parent directory
     std::vector<FSNode*> children; // List of children (Files/Dirs)
+    std::unordered_map<std::string, FSNode*> by_name; // Same children, for O(1) lookup in large directories
+    std::atomic<bool> loaded;      // children reflect the disk (always true for files and new directories)
 
     // Constructor adapts to the provided FileEntry
-    FSNode(FileEntry entry, FSNode* p = nullptr) : metadata(entry), parent(p) {}
+    FSNode(FileEntry entry, FSNode* p = nullptr) : metadata(entry), parent(p), loaded(true) {}
 };
 
 class FileSystemTree {
+public:
+    // Reads the entries of a directory from disk
+    using Loader = std::function<std::vector<FileEntry>(const FileEntry& dir)>;
+
 private:
     FSNode* root;
-    uint32_t next_inode_counter; // To assign unique inodes to new files
+    std::atomic<uint32_t> next_inode_counter; // To assign unique inodes to new files (shared by all workers)
+    Loader loader;
+    std::mutex load_mutex;         // One directory is loaded at a time; readers of a stub wait here
+    std::atomic<uint64_t> loaded_dirs;
 
-    // Helper to find a child by name in a specific node
+    // Helper to find a child by name in a specific node (parent already loaded)
     FSNode* findChild(FSNode* parent, std::string name);
+    FSNode* attach(FSNode* parent, const FileEntry& entry);
     
     // Helper to collect all children recursively (for resolving paths)
     void destroyTree(FSNode* node);
@@ -87,6 +106,13 @@ public:
     // Initialization
     void setRoot(FileEntry rootEntry);
     FSNode* getRoot();
+    void setLoader(Loader fn) { loader = std::move(fn); }
+    void markUnloaded(FSNode* dir) { dir->loaded = false; }
+
+    // Reads a stub's children from disk (no-op once loaded). Safe to call from
+    // several threads; the caller's locks must cover 'dir' as for any read.
+    void ensureLoaded(FSNode* dir);
+    uint64_t getLoadedDirCount() const { return loaded_dirs.load(); }
     
     // Traversal: Takes a path "/a/b/c" and returns the node
     FSNode* resolvePath(std::string path);
@@ -104,30 +130,157 @@ public:
 
 
 // ============================================================================
-// 3. Bitmap (For Free Space Management)
-// Tracks block usage for the .omni file
+// 3. Bitmap + Free-Extent Index (For Free Space Management)
+// The bitmap is the per-block truth; the extent index mirrors its free runs so
+// allocation never scans it. Free runs are kept twice: by offset (neighbour
+// lookup for coalescing) and by (length, offset) (best-fit lookup).
+// The bitmap is held as 64-bit words, the same bytes stored in the .omni
+// bitmap region: scans use ctz to jump over whole full/empty words.
 // ============================================================================
 
+// Block numbers stored on disk are at most 48 bits (lo word + 16-bit hi word)
+static const uint64_t MAX_DISK_BLOCKS = 1ULL << 48;
+
+// A run of consecutive blocks. Files are a list of these (see ExtentMapHeader).
+struct Extent {
+    uint64_t start;
+    uint64_t count;
+};
+
+// On-disk extent map of a file that spans several runs. FileEntry.reserved
+// locates the first block and the first map block (see ofs_tail.hpp; map 0 =
+// the file is a single run). A map block is this header followed by 'count'
+// records; more extents continue in 'next_block'. "EXT2" blocks hold Extent
+// records; "EXTM" blocks (format v1) hold ExtentV1 records and a 32-bit next
+// block followed by a zero word, which reads the same as a 64-bit one.
+struct ExtentMapHeader {
+    char magic[4];          // "EXT2" (v1: "EXTM")
+    uint32_t count;         // Extent records in this block
+    uint64_t next_block;    // Next map block, 0 = last
+};
+
+struct ExtentV1 {
+    uint32_t start;
+    uint32_t count;
+};
+
+enum class AllocPolicy {
+    BEST_FIT,   // Smallest free run that fits: O(log E)
+    NEXT_FIT    // First fitting run at/after the previous allocation
+};
+
 class BlockManager {
 private:
-    std::vector<bool> bitmap; // 0 = Free, 1 = Used
-    uint32_t total_blocks;
-    uint32_t used_blocks_count;
+    std::vector<uint64_t> words; // Bit i of word w = block 64w+i; 0 = Free, 1 = Used
+    uint64_t total_blocks;
+    uint64_t used_blocks_count;
+    mutable std::mutex mtx;   // Workers in different jails allocate concurrently
+
+    std::map<uint64_t, uint64_t> free_by_offset;           // start -> length
+    std::set<std::pair<uint64_t, uint64_t>> free_by_size;  // (length, start)
+    AllocPolicy policy;
+    uint64_t next_fit_cursor = 0;
+
+    void addFreeExtent(uint64_t start, uint64_t length);    // Coalesces with neighbours
+    void removeFreeExtent(uint64_t start, uint64_t length); // Must be an exact free run
+    void carve(uint64_t start, uint64_t count);             // Take [start, start+count) out of the free run containing it
+
+    // Ranges still being streamed to a socket (sendfile). Freeing a range that
+    // overlaps one is deferred until the last unpin, so the blocks cannot be
+    // reallocated and overwritten mid-transfer.
+    std::vector<Extent> pinned;
+    std::vector<Extent> deferred_frees;
+
+    // Blocks some snapshot still refers to (same layout as words, empty = none).
+    // Freeing one leaves it used; a later reclaim pass returns it.
+    std::vector<uint64_t> held;
+    bool isHeld(uint64_t block) const { return !held.empty() && ((held[block >> 6] >> (block & 63)) & 1); }
+
+    // Receives every changed word range so the on-disk copy follows the bitmap
+    std::function<void(uint64_t byte_offset, const void* data, size_t len)> persist;
+
+    uint64_t nextFree(uint64_t from, uint64_t limit) const; // First free block in [from, limit), else limit
+    uint64_t nextUsed(uint64_t from, uint64_t limit) const; // First used block in [from, limit), else limit
+    void setRange(uint64_t start, uint64_t count, bool used);
+    void rebuildExtents();
+
+    void markUsedLocked(uint64_t start_index, uint64_t count);
+    void freeBlocksLocked(uint64_t start_index, uint64_t count);
+    bool overlapsPinned(uint64_t start_index, uint64_t count) const;
 
 public:
-    BlockManager(uint32_t num_blocks);
+    BlockManager(uint64_t num_blocks, AllocPolicy alloc_policy = AllocPolicy::BEST_FIT);
     
-    // Allocates 'count' consecutive blocks. Returns start_index or -1.
-    int allocateBlocks(int count);
+    // Allocates 'count' consecutive blocks. Returns start_index, or 0 when
+    // there is no such run (block 0 is the header, never handed out).
+    uint64_t allocateBlocks(uint64_t count);
+
+    // Allocates 'count' blocks as one run if possible, otherwise gathers the
+    // largest free runs (fewest extents). All or nothing.
+    bool allocateExtents(uint64_t count, std::vector<Extent>& out);
     
     // Frees blocks starting at index
-    void freeBlocks(int start_index, int count);
+    void freeBlocks(uint64_t start_index, uint64_t count);
+
+    // Grows the run [start_index, start_index + count) in place to new_count
+    // blocks if the blocks right after it are free. Returns false otherwise.
+    bool extendBlocks(uint64_t start_index, uint64_t count, uint64_t new_count);
     
     // Helper to mark specific blocks as used (e.g., during fs_init loading)
-    void markUsed(int start_index, int count);
+    void markUsed(uint64_t start_index, uint64_t count);
+
+    // Protect a range from reuse while it is read outside the filesystem locks
+    void pin(uint64_t start_index, uint64_t count);
+    void unpin(uint64_t start_index, uint64_t count);
+    // Held by a snapshot or pinned by a transfer: its bytes must not change in place
+    bool isFrozen(uint64_t block) const;
+    // First used block in [from, limit), else limit (word scan)
+    uint64_t firstUsed(uint64_t from, uint64_t limit) const;
     
-    uint32_t getFreeBlocksCount() const;
-    uint32_t getTotalBlocks() const;
+    // On-disk bitmap: size in bytes, bulk load, and write-through of changes.
+    // persistAll(true) skips all-zero words: the region is known to be zero
+    // (a new sparse image), so the untouched range stays unallocated.
+    static uint64_t bitmapBytes(uint64_t num_blocks) { return (num_blocks + 63) / 64 * 8; }
+    void loadBitmap(std::vector<uint64_t> disk_words);
+    void setPersistHook(std::function<void(uint64_t, const void*, size_t)> hook);
+    void persistAll(bool skip_zero = false);
+
+    // Snapshots: a copy of the words, the blocks that must survive frees, and
+    // a move to another bitmap (used blocks not in target are freed, unless
+    // held or pinned; target blocks are marked used)
+    std::vector<uint64_t> getBitmap() const;
+    void setHeld(std::vector<uint64_t> mask);
+    void resetBitmap(const std::vector<uint64_t>& target);
+
+    uint64_t getFreeBlocksCount() const;
+    uint64_t getTotalBlocks() const;
+    uint64_t getFreeExtentCount() const;
+    uint64_t getLargestFreeExtent() const;
+};
+
+
+// ============================================================================
+// 4. Slot Map (For the User Table)
+// A fixed table of named records (one UserInfo per slot): a bitmap of the
+// slots in use plus name -> slot, so inserts and removals go straight to the
+// record's offset instead of reading the table. Not locked: the user table is
+// only changed under the exclusive namespace lock.
+// ============================================================================
+
+class SlotMap {
+private:
+    std::vector<uint64_t> words;   // Bit i of word w = slot 64w+i; 1 = In use
+    uint32_t slots = 0;
+    std::unordered_map<std::string, uint32_t> by_name;
+
+public:
+    void reset(uint32_t slot_count);                    // All free
+    void claim(uint32_t slot, const std::string& name); // Loading: slot holds name
+    int acquire(const std::string& name);               // Lowest free slot, now name's. -1 = full
+    int find(const std::string& name) const;            // -1 = not there
+    int release(const std::string& name);               // Frees name's slot and returns it
+    uint32_t getUsed() const { return by_name.size(); }
+    uint32_t getCapacity() const { return slots; }
 };
 
 #endif // OFS_STRUCTURES_H
\ No newline at end of file
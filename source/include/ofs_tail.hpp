@@ -0,0 +1,110 @@
+/**
+ * @file ofs_tail.hpp
+ * @brief Small-file packing: inline/tail layout flags and shared tail blocks
+ * @location source/include/ofs_tail.hpp
+ */
+
+#ifndef OFS_TAIL_H
+#define OFS_TAIL_H
+
+#include "ofs_structures.hpp"
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <set>
+#include <mutex>
+
+// ============================================================================
+// 1. Block map
+// FileEntry::reserved[0..7] locates the file's whole blocks (first block,
+// extent map: for a directory, its first directory block). Block numbers are
+// 48 bits: the low words sit in bytes 0-7 and the high 16 bits in bytes
+// 24-27, which are zero in format v1 images. Bytes 8-15 say what else there
+// is. A file written before packing has zeros here and owns
+// size / block_size + 1 blocks. A compressed file (ofs_codec.hpp) keeps its
+// stored size in bytes 16-23; the layout then applies to the stored bytes
+// instead of the content.
+// ============================================================================
+
+uint64_t firstBlock(const uint8_t* block_map);     // Bytes 0-3 + 24-25
+uint64_t mapBlock(const uint8_t* block_map);       // Bytes 4-7 + 26-27
+void setFirstBlock(uint8_t* block_map, uint64_t block);
+void setMapBlock(uint8_t* block_map, uint64_t block);
+
+enum PackFlags : uint8_t {
+    PACK_INLINE = 1,    // No blocks: the bytes are in the inode record (DiskInode::inline_data)
+    PACK_TAIL = 2,      // size / block_size whole blocks, then size % block_size bytes in a tail fragment
+    PACK_EXACT = 4,     // ceil(size / block_size) whole blocks and nothing else
+    PACK_COMPRESSED = 8 // Stored as frames (ofs_codec.hpp), stored size in reserved[16..23]
+};
+
+// Bytes 8-15: tail block low word, fragment, flags, tail block high 16 bits
+struct PackedRef {
+    uint64_t tail_block = 0;    // PACK_TAIL: the shared block holding the tail
+    uint8_t fragment = 0;       // PACK_TAIL: its first fragment there
+    uint8_t flags = 0;          // PackFlags, 0 = written before packing
+};
+
+PackedRef packedRef(const uint8_t* block_map);              // From reserved[8..15]
+void setPackedRef(uint8_t* block_map, const PackedRef& ref);
+
+
+// ============================================================================
+// 2. Tail blocks
+// Cut into FRAGMENTS equal fragments. Fragment 0 starts with a TailBlockHeader
+// whose mask says which fragments are taken. A tail is a run of consecutive
+// fragments in one block. The header is rewritten in place, so a tail block
+// is metadata as far as snapshots go (they copy it).
+// ============================================================================
+
+struct TailBlockHeader {
+    char magic[4];      // "TAIL"
+    uint32_t used;      // Bit i = fragment i taken (bit 0: this header)
+};
+
+
+// ============================================================================
+// 3. TailStore
+// Hands out and takes back fragment runs. Header updates go through the write
+// callback (the server's journaled writeMeta); tail bytes are written by the
+// caller. Only blocks touched since startup are known: a block with room
+// joins the pool when one of its fragments is released, so startup needs no
+// scan. A block whose last tail goes is freed. Internally locked, because
+// workers in different jails write concurrently.
+// ============================================================================
+
+class TailStore {
+public:
+    static const uint32_t FRAGMENTS = 32;
+
+    using ReadFn = std::function<void(uint64_t, void*, size_t)>;
+    using WriteFn = std::function<void(uint64_t, const void*, size_t)>;
+
+    TailStore(uint32_t block_size, BlockManager* block_manager, ReadFn read, WriteFn write);
+
+    uint32_t fragmentSize() const { return block_size / FRAGMENTS; }
+    uint32_t maxTail() const { return block_size / 2; }     // Longer tails keep a block of their own
+    uint64_t offsetOf(uint64_t block, uint8_t fragment) const {
+        return block * block_size + (uint64_t)fragment * fragmentSize();
+    }
+
+    // Room for len bytes (1..maxTail()). False when no block could be allocated.
+    bool allocate(uint32_t len, uint64_t& block, uint8_t& fragment);
+    void release(uint64_t block, uint8_t fragment, uint32_t len);
+    void invalidate();      // Forgets every known block (rewritten underneath by a snapshot restore)
+
+private:
+    uint32_t block_size;
+    BlockManager* blocks;
+    ReadFn readAt;
+    WriteFn writeAt;
+
+    std::mutex mtx;
+    std::unordered_map<uint64_t, uint32_t> masks;  // Known tail blocks -> used mask
+    std::set<uint64_t> open;                       // Those with a free fragment, in block order
+
+    uint32_t fragmentsFor(uint32_t len) const { return (len + fragmentSize() - 1) / fragmentSize(); }
+    void setMask(uint64_t block, uint32_t mask);   // Caller holds mtx
+};
+
+#endif // OFS_TAIL_H
@@ -0,0 +1,126 @@
+/**
+ * @file ofs_vault.hpp
+ * @brief Delta Vault: file versions and image snapshots (region at file_state_storage_offset)
+ * @location source/include/ofs_vault.hpp
+ */
+
+#ifndef OFS_VAULT_H
+#define OFS_VAULT_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+// ============================================================================
+// 1. On-disk format
+// The region's first block is a VaultHeader followed by the snapshot table.
+// The version table fills the blocks after it. Nothing in the vault holds
+// file bytes. A version is an old block map, and a snapshot is a copy of the
+// metadata blocks. Data blocks are never written in place (a write always
+// goes to new blocks), so keeping the old map is enough to keep the old bytes.
+// ============================================================================
+
+struct VaultHeader {
+    char magic[8];              // "DVAULT01"
+    uint32_t version_blocks;    // Blocks of VersionRecords after this one
+    uint32_t snapshot_slots;    // SnapshotRecords after this header
+    uint8_t reserved[48];
+};
+
+struct SnapshotRecord {
+    char name[32];
+    uint64_t created_time;
+    uint32_t manifest_block;    // First manifest block (low 32 bits), 0 with manifest_hi = free slot
+    uint32_t copied_blocks;     // Metadata blocks in the manifest
+    uint32_t manifest_hi;       // Its high bits (0 in format v1)
+    uint32_t reserved[3];
+
+    uint64_t manifest() const { return ((uint64_t)manifest_hi << 32) | manifest_block; }
+    void setManifest(uint64_t block) {
+        manifest_block = static_cast<uint32_t>(block);
+        manifest_hi = static_cast<uint32_t>(block >> 32);
+    }
+};
+
+struct VersionRecord {
+    uint32_t inode;             // 0 = free slot
+    uint32_t version;           // Per inode, counting up from 1
+    uint64_t size;
+    uint64_t modified_time;     // When this content was written
+    uint64_t archived_time;     // When it stopped being current
+    uint8_t block_map[32];      // FileEntry::reserved[0..31]: block map (ofs_tail.hpp) and stored size
+};
+
+// Manifest of a snapshot: a chain of blocks, each this header followed by
+// 'count' (original, copy) block pairs. "SNP2" blocks hold SnapshotBlock
+// pairs; "SNAP" blocks (format v1) hold SnapshotBlockV1 pairs and a 32-bit
+// next block followed by a zero word.
+struct SnapshotManifest {
+    char magic[4];              // "SNP2" (v1: "SNAP")
+    uint32_t count;
+    uint64_t next_block;        // 0 = last
+};
+
+struct SnapshotBlock {
+    uint64_t original;
+    uint64_t copy;
+};
+
+struct SnapshotBlockV1 {
+    uint32_t original;
+    uint32_t copy;
+};
+
+static_assert(sizeof(VaultHeader) == 64, "VaultHeader must stay 64 bytes");
+static_assert(sizeof(SnapshotRecord) == 64, "SnapshotRecord must stay 64 bytes");
+static_assert(sizeof(VersionRecord) == 64, "VersionRecord must stay 64 bytes");
+
+
+// ============================================================================
+// 2. VersionTable
+// Fixed slots on disk, indexed in memory by inode (built with one bulk read at
+// load). Each change is one positioned write of a record through the write
+// callback (the server's journaled writeMeta). Internally locked, because
+// workers in different jails archive concurrently. When every slot is taken,
+// the oldest version in the image gives up its slot.
+// ============================================================================
+
+class VersionTable {
+public:
+    using ReadFn = std::function<void(uint64_t, void*, size_t)>;
+    using WriteFn = std::function<void(uint64_t, const void*, size_t)>;
+
+    VersionTable(uint64_t offset, uint32_t slots, ReadFn read, WriteFn write);
+
+    void load();
+
+    // Stores rec as the newest version of rec.inode (its number is assigned
+    // here), keeping at most 'keep' versions of that file. Records that had
+    // to go are returned; the caller frees their blocks.
+    std::vector<VersionRecord> archive(VersionRecord rec, uint32_t keep);
+    std::vector<VersionRecord> list(uint32_t inode);               // Oldest first
+    bool take(uint32_t inode, uint32_t version, VersionRecord& out); // Removes it
+    std::vector<VersionRecord> prune(uint32_t inode, uint32_t keep); // Removes the oldest beyond keep
+    void forEach(const std::function<void(const VersionRecord&)>& fn);
+
+    uint32_t getCount();
+    uint32_t getCapacity() const { return slots; }
+    uint64_t slotOffset(uint32_t slot) const { return offset + (uint64_t)slot * sizeof(VersionRecord); }
+
+private:
+    uint64_t offset;
+    uint32_t slots;
+    ReadFn readAt;
+    WriteFn writeAt;
+
+    std::mutex mtx;
+    std::vector<VersionRecord> records;                          // Mirror of the slots
+    std::unordered_map<uint32_t, std::vector<uint32_t>> by_inode; // Slots, oldest version first
+    std::vector<uint32_t> free_slots;
+
+    void release(uint32_t slot);    // Caller holds mtx
+};
+
+#endif // OFS_VAULT_H
@@ -0,0 +1,211 @@
+/**
+ * @file ofs_cache.cpp
+ * @brief Buffer pool over a storage backend (block frames, CLOCK eviction, write-back)
+ * @location source/server/core/ofs_cache.cpp
+ */
+
+#include "../../include/ofs_cache.hpp"
+#include <cstring>
+#include <algorithm>
+
+BufferPool::BufferPool(std::unique_ptr<StorageBackend> backend, uint32_t n, uint32_t bs)
+    : inner(std::move(backend)), block_size(bs), frames(n), memory((uint64_t)n * bs) {
+    for (uint32_t f = n; f-- > 0;) free_frames.push_back(f); // Frame 0 handed out first
+}
+
+BufferPool::~BufferPool() {
+    std::lock_guard<std::mutex> lock(mtx);
+    writeBackAll();
+}
+
+// ============================================================================
+// FRAMES
+// ============================================================================
+
+int BufferPool::pinBlock(uint64_t block, bool whole) {
+    auto it = table.find(block);
+    if (it != table.end()) {
+        Frame& fr = frames[it->second];
+        fr.pins++;
+        fr.referenced = true;
+        stats.hits++;
+        return static_cast<int>(it->second);
+    }
+    int f = victim();
+    if (f < 0) return -1;
+    Frame& fr = frames[f];
+    fr.block = block;
+    fr.pins = 1;
+    fr.valid = true;
+    fr.dirty = false;
+    fr.referenced = true;
+    table[block] = f;
+    stats.misses++;
+    if (!whole) {
+        uint64_t at = block * block_size;
+        inner->read(at, frameData(f), std::min<uint64_t>(block_size, inner->size() - at));
+    }
+    return f;
+}
+
+void BufferPool::unpin(uint32_t f, bool dirtied) {
+    Frame& fr = frames[f];
+    fr.pins--;
+    // Marked now rather than at pin time: a flush that ran during the copy
+    // may have written half of it, so the frame must go out again
+    if (dirtied && !fr.dirty) {
+        fr.dirty = true;
+        stats.dirty++;
+    }
+}
+
+// CLOCK: a referenced frame gets a second chance, pinned frames are skipped
+int BufferPool::victim() {
+    if (!free_frames.empty()) {
+        uint32_t f = free_frames.back();
+        free_frames.pop_back();
+        return static_cast<int>(f);
+    }
+    for (size_t scanned = 0; scanned < 2 * frames.size(); scanned++) {
+        uint32_t f = hand;
+        hand = (hand + 1) % frames.size();
+        Frame& fr = frames[f];
+        if (fr.pins) continue;
+        if (fr.referenced) {
+            fr.referenced = false;
+            continue;
+        }
+        if (fr.dirty) writeBack(f);
+        table.erase(fr.block);
+        fr.valid = false;
+        stats.evictions++;
+        return static_cast<int>(f);
+    }
+    return -1;
+}
+
+void BufferPool::writeBack(uint32_t f) {
+    Frame& fr = frames[f];
+    uint64_t at = fr.block * block_size;
+    inner->write(at, frameData(f), std::min<uint64_t>(block_size, inner->size() - at));
+    fr.dirty = false;
+    stats.dirty--;
+    stats.writebacks++;
+}
+
+// In block order, so the backend sees the writes as sequentially as possible
+void BufferPool::writeBackAll() {
+    if (stats.dirty == 0) return;
+    std::vector<std::pair<uint64_t, uint32_t>> dirty;
+    for (uint32_t f = 0; f < frames.size(); f++) {
+        if (frames[f].valid && frames[f].dirty) dirty.push_back({frames[f].block, f});
+    }
+    std::sort(dirty.begin(), dirty.end());
+    for (const auto& d : dirty) writeBack(d.second);
+}
+
+void BufferPool::settleRange(uint64_t first, uint64_t last, bool drop) {
+    std::lock_guard<std::mutex> lock(mtx);
+    stats.bypassed++;
+    if (table.empty()) return;
+    for (uint64_t b = first; b <= last; b++) {
+        auto it = table.find(b);
+        if (it == table.end()) continue;
+        uint32_t f = it->second;
+        if (frames[f].dirty) writeBack(f);
+        if (drop && frames[f].pins == 0) {
+            table.erase(it);
+            frames[f].valid = false;
+            free_frames.push_back(f);
+        }
+    }
+}
+
+// ============================================================================
+// BACKEND INTERFACE
+// ============================================================================
+
+void BufferPool::read(uint64_t offset, void* buf, size_t len) {
+    if (len == 0) return;
+    uint64_t first = offset / block_size, last = (offset + len - 1) / block_size;
+    if (frames.empty() || last - first >= BYPASS_BLOCKS) {
+        if (!frames.empty()) settleRange(first, last, false);
+        inner->read(offset, buf, len);
+        return;
+    }
+    char* dst = static_cast<char*>(buf);
+    for (uint64_t b = first; b <= last; b++) {
+        uint64_t start = std::max(offset, b * block_size);
+        uint64_t stop = std::min<uint64_t>(offset + len, (b + 1) * block_size);
+        std::unique_lock<std::mutex> lock(mtx);
+        int f = pinBlock(b, false);
+        if (f < 0) { // Every frame pinned: not cached, so the backend is current
+            lock.unlock();
+            inner->read(start, dst + (start - offset), stop - start);
+            continue;
+        }
+        // A small copy is cheaper than a second trip through the lock
+        if (stop - start > SMALL_COPY) lock.unlock();
+        std::memcpy(dst + (start - offset), frameData(f) + (start - b * block_size), stop - start);
+        if (!lock.owns_lock()) lock.lock();
+        unpin(f, false);
+    }
+}
+
+void BufferPool::write(uint64_t offset, const void* buf, size_t len) {
+    if (len == 0) return;
+    uint64_t first = offset / block_size, last = (offset + len - 1) / block_size;
+    if (frames.empty() || last - first >= BYPASS_BLOCKS) {
+        if (!frames.empty()) settleRange(first, last, true);
+        inner->write(offset, buf, len);
+        return;
+    }
+    const char* src = static_cast<const char*>(buf);
+    for (uint64_t b = first; b <= last; b++) {
+        uint64_t start = std::max(offset, b * block_size);
+        uint64_t stop = std::min<uint64_t>(offset + len, (b + 1) * block_size);
+        bool whole = (start == b * block_size && stop == (b + 1) * block_size);
+        std::unique_lock<std::mutex> lock(mtx);
+        int f = pinBlock(b, whole);
+        if (f < 0) {
+            lock.unlock();
+            inner->write(start, src + (start - offset), stop - start);
+            continue;
+        }
+        if (stop - start > SMALL_COPY) lock.unlock();
+        std::memcpy(frameData(f) + (start - b * block_size), src + (start - offset), stop - start);
+        if (!lock.owns_lock()) lock.lock();
+        unpin(f, true);
+    }
+}
+
+void BufferPool::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        writeBackAll();
+    }
+    inner->flush();
+}
+
+void BufferPool::sync() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        writeBackAll();
+    }
+    inner->sync();
+}
+
+void BufferPool::datasync() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        writeBackAll();
+    }
+    inner->datasync();
+}
+
+CacheStats BufferPool::getStats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    CacheStats s = stats;
+    s.frames = frames.size();
+    return s;
+}
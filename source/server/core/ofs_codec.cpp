@@ -0,0 +1,227 @@
+/**
+ * @file ofs_codec.cpp
+ * @brief Transparent file compression: a small LZ77 codec and the frame format
+ * @location source/server/core/ofs_codec.cpp
+ */
+
+#include "../../include/ofs_codec.hpp"
+#include <cstring>
+#include <algorithm>
+
+static const int HASH_BITS = 14;
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+
+static inline uint32_t read32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// ============================================================================
+// COMPRESSION
+// ============================================================================
+
+// A length past its 4-bit field: 255s, then the remainder
+static bool putLength(char*& op, const char* end, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (op >= end) return false;
+        *op++ = static_cast<char>(255);
+    }
+    if (op >= end) return false;
+    *op++ = static_cast<char>(n);
+    return true;
+}
+
+// match_len 0: the last sequence, literals only
+static bool putSequence(char*& op, const char* end, const char* lit, size_t lit_len, size_t offset, size_t match_len) {
+    if (op >= end) return false;
+    char* token = op++;
+    uint8_t t = static_cast<uint8_t>(std::min<size_t>(lit_len, 15) << 4);
+    if (lit_len >= 15 && !putLength(op, end, lit_len - 15)) return false;
+    if ((size_t)(end - op) < lit_len) return false;
+    std::memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        if (end - op < 2) return false;
+        *op++ = static_cast<char>(offset & 0xff);
+        *op++ = static_cast<char>(offset >> 8);
+        size_t m = match_len - MIN_MATCH;
+        t |= static_cast<uint8_t>(std::min<size_t>(m, 15));
+        if (m >= 15 && !putLength(op, end, m - 15)) return false;
+    }
+    *token = static_cast<char>(t);
+    return true;
+}
+
+size_t lzCompress(const char* src, size_t len, char* dst, size_t cap) {
+    thread_local uint32_t table[1 << HASH_BITS]; // Position + 1 of the last prefix with this hash
+    std::memset(table, 0, sizeof(table));
+    char* op = dst;
+    const char* end = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    while (ip + MIN_MATCH <= len) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash4(seq);
+        size_t ref = table[h];
+        table[h] = static_cast<uint32_t>(ip + 1);
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6); // Step up through data that keeps missing
+            continue;
+        }
+        ref--;
+
+        // Extend 8 bytes at a time, then to the first differing byte
+        size_t m = MIN_MATCH;
+        while (ip + m + 8 <= len) {
+            uint64_t a, b;
+            std::memcpy(&a, src + ip + m, 8);
+            std::memcpy(&b, src + ref + m, 8);
+            if (a != b) {
+                m += __builtin_ctzll(a ^ b) >> 3;
+                goto extended;
+            }
+            m += 8;
+        }
+        while (ip + m < len && src[ref + m] == src[ip + m]) m++;
+    extended:
+        if (!putSequence(op, end, src + anchor, ip - anchor, ip - ref, m)) return 0;
+        ip += m;
+        anchor = ip;
+        if (ip + 2 <= len && ip >= 2) table[hash4(read32(src + ip - 2))] = static_cast<uint32_t>(ip - 1);
+    }
+    if (!putSequence(op, end, src + anchor, len - anchor, 0, 0)) return 0;
+    return op - dst;
+}
+
+bool lzDecompress(const char* src, size_t len, char* dst, size_t raw_len) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* iend = ip + len;
+    char* op = dst;
+    char* oend = dst + raw_len;
+    auto getLength = [&](size_t& n) {
+        uint8_t b;
+        do {
+            if (ip >= iend) return false;
+            b = *ip++;
+            n += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !getLength(lit)) return false;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return false;
+        std::memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break; // Last sequence: literals only
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t m = token & 15;
+        if (m == 15 && !getLength(m)) return false;
+        m += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < m) return false;
+        const char* from = op - offset;
+        if (offset >= m) {
+            std::memcpy(op, from, m);
+            op += m;
+        } else {
+            for (size_t i = 0; i < m; i++) *op++ = from[i]; // Overlapping: a repeated pattern
+        }
+    }
+    return op == oend;
+}
+
+// ============================================================================
+// FRAMES
+// ============================================================================
+
+bool appendFrame(std::string& out, const char* src, uint32_t len) {
+    size_t at = out.size();
+    out.resize(at + sizeof(FrameHeader) + len);
+    char* payload = &out[at + sizeof(FrameHeader)];
+    size_t n = len > 1 ? lzCompress(src, len, payload, len - 1) : 0; // Must shrink
+    bool compressed = n != 0;
+    if (!compressed) {
+        std::memcpy(payload, src, len);
+        n = len;
+    }
+    FrameHeader fh;
+    fh.raw_len = len;
+    fh.stored_len = compressed ? static_cast<uint32_t>(n) : (len | FRAME_RAW);
+    std::memcpy(&out[at], &fh, sizeof(fh));
+    out.resize(at + sizeof(fh) + n);
+    return compressed;
+}
+
+std::string encodeFrames(const char* src, uint64_t len) {
+    std::string out;
+    for (uint64_t at = 0; at < len; at += FRAME_BYTES) {
+        appendFrame(out, src + at, static_cast<uint32_t>(std::min<uint64_t>(FRAME_BYTES, len - at)));
+    }
+    return out;
+}
+
+void appendPadding(std::string& out, uint64_t bytes) {
+    const uint64_t most = sizeof(FrameHeader) + FRAME_BYTES;
+    while (bytes > 0) {
+        uint64_t n = std::min(bytes, most);
+        if (bytes > n && bytes - n < sizeof(FrameHeader)) n -= sizeof(FrameHeader); // Leave room for a header
+        FrameHeader fh;
+        fh.raw_len = 0;
+        fh.stored_len = static_cast<uint32_t>(n - sizeof(fh));
+        out.append(reinterpret_cast<const char*>(&fh), sizeof(fh));
+        out.append(n - sizeof(fh), '\0');
+        bytes -= n;
+    }
+}
+
+bool decodeFrames(const StoredReader& read, uint64_t stored_size, uint64_t offset,
+                  char* buf, uint64_t len, FrameCursor* cursor) {
+    FrameCursor c;
+    if (cursor && cursor->raw <= offset) c = *cursor;
+    std::string in, out;
+
+    while (len > 0) {
+        if (c.at + sizeof(FrameHeader) > stored_size) return false;
+        FrameHeader fh;
+        read(c.at, reinterpret_cast<char*>(&fh), sizeof(fh));
+        uint32_t stored = fh.stored_len & ~FRAME_RAW;
+        if (fh.raw_len > FRAME_BYTES || stored > FRAME_BYTES || c.at + sizeof(fh) + stored > stored_size) return false;
+        if ((fh.stored_len & FRAME_RAW) && stored != fh.raw_len) return false;
+
+        if (offset < c.raw + fh.raw_len) {
+            uint64_t from = offset - c.raw;
+            uint64_t n = std::min<uint64_t>(len, fh.raw_len - from);
+            uint64_t payload = c.at + sizeof(fh);
+            if (fh.stored_len & FRAME_RAW) {
+                read(payload + from, buf, n);
+            } else {
+                in.resize(stored);
+                read(payload, &in[0], stored);
+                bool whole = (from == 0 && n == fh.raw_len);
+                if (!whole) out.resize(fh.raw_len);
+                if (!lzDecompress(in.data(), stored, whole ? buf : &out[0], fh.raw_len)) return false;
+                if (!whole) std::memcpy(buf, out.data() + from, n);
+            }
+            buf += n;
+            offset += n;
+            len -= n;
+        }
+        if (cursor) *cursor = c; // Still the frame holding 'offset' when len reached 0
+        if (len == 0) break;
+        c.raw += fh.raw_len;
+        c.at += sizeof(fh) + stored;
+    }
+    return true;
+}
@@ -0,0 +1,377 @@
+/**
+ * @file ofs_journal.cpp
+ * @brief Write-ahead metadata journal with group commit (region at change_log_offset)
+ * @location source/server/core/ofs_journal.cpp
+ */
+
+#include "../../include/ofs_journal.hpp"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+static const uint32_t JOURNAL_RECORD_MAGIC = 0x314E5854; // "TXN1"
+
+namespace {
+
+// The handle (if any) the calling thread is inside
+struct HandleState {
+    bool in = false;
+    bool wrote = false;
+    uint64_t seq = 0;
+};
+thread_local HandleState handle;
+
+uint64_t pad8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+uint32_t crc32(const char* data, size_t len) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) c = table[(c ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+}
+
+Journal::Journal(StorageBackend* s, uint64_t offset, uint64_t size, uint32_t bs)
+    : storage(s), region(offset), capacity(size > bs ? size - bs : 0), block_size(bs), overlay_blocks(0) {
+    running.seq = 1;
+}
+
+Journal::~Journal() {
+    stop();
+}
+
+void Journal::format(StorageBackend* storage, uint64_t offset) {
+    JournalHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, "OFSWAL01", 8);
+    h.first_seq = 1;
+    storage->write(offset, &h, sizeof(h));
+}
+
+void Journal::writeHeader(uint64_t first_seq) {
+    JournalHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, "OFSWAL01", 8);
+    h.first_seq = first_seq;
+    storage->write(region, &h, sizeof(h));
+}
+
+// --- REPLAY ---
+uint64_t Journal::replay() {
+    JournalHeader h;
+    storage->read(region, &h, sizeof(h));
+    uint64_t expect = (std::memcmp(h.magic, "OFSWAL01", 8) == 0 && h.first_seq > 0) ? h.first_seq : 1;
+
+    uint64_t pos = 0, count = 0;
+    std::vector<char> body;
+    while (pos + sizeof(JournalRecord) <= capacity) {
+        JournalRecord rec;
+        storage->read(recordsAt() + pos, &rec, sizeof(rec));
+        if (rec.magic != JOURNAL_RECORD_MAGIC || rec.seq != expect) break;
+        if (rec.length < sizeof(rec) || rec.length % 8 != 0 || rec.length > capacity - pos) break;
+        body.resize(rec.length - sizeof(rec));
+        storage->read(recordsAt() + pos + sizeof(rec), body.data(), body.size());
+        if (crc32(body.data(), body.size()) != rec.crc) break; // Torn tail: never committed
+
+        applyEntries(body.data(), body.size(), rec.entries);
+        pos += rec.length;
+        expect++;
+        count++;
+    }
+    if (count > 0) storage->datasync();
+
+    // Start over with an empty log
+    writeHeader(expect);
+    storage->datasync();
+    std::lock_guard<std::mutex> lock(mtx);
+    running = Transaction();
+    running.seq = expect;
+    committed = expect - 1;
+    head = 0;
+    return count;
+}
+
+void Journal::applyEntries(const char* body, uint64_t len, uint32_t entries) {
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < entries && pos + sizeof(JournalEntry) <= len; i++) {
+        JournalEntry e;
+        std::memcpy(&e, body + pos, sizeof(e));
+        pos += sizeof(e);
+        if (e.length > len - pos) break;
+        storage->write(e.offset, body + pos, e.length);
+        pos += pad8(e.length);
+    }
+}
+
+// --- COMMIT THREAD ---
+void Journal::start() {
+    committer = std::thread(&Journal::commitLoop, this);
+}
+
+void Journal::stop() {
+    if (!committer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+        commit_wanted = true;
+    }
+    commit_cv.notify_all();
+    committer.join();
+
+    // Checkpoint: everything is in place, so the next boot has nothing to replay
+    storage->datasync();
+    std::lock_guard<std::mutex> lock(mtx);
+    writeHeader(running.seq);
+    storage->datasync();
+    head = 0;
+}
+
+void Journal::commitLoop() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        commit_cv.wait(lock, [this] { return stopping || (commit_wanted && running.entries > 0); });
+        if (running.entries == 0) {
+            commit_wanted = false;
+            if (stopping) return;
+            continue;
+        }
+
+        // Close the transaction: no new handles until the open ones finish
+        closing = true;
+        commit_cv.wait(lock, [this] { return running.active == 0; });
+        Transaction txn = std::move(running);
+        running = Transaction();
+        running.seq = txn.seq + 1;
+        closing = false;
+        commit_wanted = false;
+        handle_cv.notify_all();
+
+        lock.unlock();
+        commit(txn);
+        lock.lock();
+
+        committed = txn.seq;
+        for (auto it = overlay.begin(); it != overlay.end();) {
+            if (it->second.seq <= txn.seq) it = overlay.erase(it);
+            else ++it;
+        }
+        overlay_blocks = overlay.size();
+        logged.insert(txn.blocks.begin(), txn.blocks.end());
+        stats.commits++;
+        stats.operations += txn.operations;
+        stats.bytes += sizeof(JournalRecord) + txn.body.size();
+
+        std::vector<Callback> ready;
+        while (!waiting.empty() && waiting.begin()->first <= committed) {
+            for (Callback& fn : waiting.begin()->second) ready.push_back(std::move(fn));
+            waiting.erase(waiting.begin());
+        }
+        lock.unlock();
+        for (Callback& fn : ready) fn();
+        lock.lock();
+    }
+}
+
+// Log, sync, apply. Only the commit thread writes the log and moves head;
+// head is atomic because getUsedBytes() reads it from other threads.
+void Journal::commit(Transaction& txn) {
+    uint64_t len = sizeof(JournalRecord) + txn.body.size();
+    if (len > capacity) {
+        std::cerr << "[JOURNAL] Transaction " << txn.seq << " (" << len << " bytes) exceeds the log; written unjournaled" << std::endl;
+        storage->datasync();
+        applyEntries(txn.body.data(), txn.body.size(), txn.entries);
+        storage->datasync();
+        return;
+    }
+
+    if (head + len > capacity) {
+        // Checkpoint: records already applied become durable in place, then the log restarts
+        storage->datasync();
+        writeHeader(txn.seq);
+        storage->datasync();
+        head = 0;
+        std::lock_guard<std::mutex> lock(mtx);
+        logged.clear();
+        stats.checkpoints++;
+    }
+
+    JournalRecord rec;
+    rec.magic = JOURNAL_RECORD_MAGIC;
+    rec.entries = txn.entries;
+    rec.seq = txn.seq;
+    rec.length = len;
+    rec.crc = crc32(txn.body.data(), txn.body.size());
+    rec.reserved = 0;
+    storage->write(recordsAt() + head, &rec, sizeof(rec));
+    storage->write(recordsAt() + head + sizeof(rec), txn.body.data(), txn.body.size());
+    storage->datasync(); // The commit point, for every operation in txn (and their data blocks)
+    head += len;
+
+    applyEntries(txn.body.data(), txn.body.size(), txn.entries);
+}
+
+// --- HANDLES ---
+void Journal::begin() {
+    std::unique_lock<std::mutex> lock(mtx);
+    handle_cv.wait(lock, [this] { return !closing; });
+    running.active++;
+    handle.in = true;
+    handle.wrote = false;
+    handle.seq = running.seq;
+}
+
+uint64_t Journal::end() {
+    std::lock_guard<std::mutex> lock(mtx);
+    handle.in = false;
+    running.active--; // Still the transaction begin() joined: it cannot commit while we are inside
+    if (handle.wrote) {
+        running.operations++;
+        commit_wanted = true;
+    }
+    if (handle.wrote || (closing && running.active == 0)) commit_cv.notify_all();
+    return handle.wrote ? handle.seq : 0;
+}
+
+// Appends one write to the running transaction and to the overlay. Caller
+// holds mtx and is inside a handle (or stands in for one).
+void Journal::record(uint64_t offset, const void* buf, size_t len) {
+    const char* src = static_cast<const char*>(buf);
+    uint64_t end_off = offset + len;
+    for (uint64_t b = offset / block_size; (uint64_t)b * block_size < end_off; b++) {
+        uint64_t start = std::max<uint64_t>(offset, b * block_size);
+        uint64_t stop_at = std::min<uint64_t>(end_off, (b + 1) * block_size);
+        auto it = overlay.find(b);
+        if (it == overlay.end()) {
+            Pending p;
+            p.data.resize(block_size);
+            storage->read(b * block_size, p.data.data(), block_size); // In place is current: nothing pending
+            it = overlay.emplace(b, std::move(p)).first;
+        }
+        std::memcpy(it->second.data.data() + (start - b * block_size), src + (start - offset), stop_at - start);
+        it->second.seq = running.seq;
+        running.blocks.insert(b);
+    }
+    overlay_blocks = overlay.size();
+
+    JournalEntry e;
+    e.offset = offset;
+    e.length = static_cast<uint32_t>(len);
+    e.reserved = 0;
+    size_t at = running.body.size();
+    running.body.resize(at + sizeof(e) + pad8(len), 0);
+    std::memcpy(running.body.data() + at, &e, sizeof(e));
+    std::memcpy(running.body.data() + at + sizeof(e), buf, len);
+    running.entries++;
+}
+
+void Journal::write(uint64_t offset, const void* buf, size_t len) {
+    if (len == 0) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    record(offset, buf, len);
+    if (handle.in) {
+        handle.wrote = true;
+    } else {
+        // A lone write (e.g. a deferred free after sendfile): joins whichever
+        // transaction is current, even a closing one, so it never waits
+        commit_wanted = true;
+        commit_cv.notify_all();
+    }
+}
+
+// Direct, except for blocks the log or the overlay still has metadata for
+void Journal::writeData(uint64_t offset, const void* buf, size_t len) {
+    if (len == 0) return;
+    const char* src = static_cast<const char*>(buf);
+    uint64_t end_off = offset + len;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool journaled = false;
+        for (uint64_t b = offset / block_size; b * block_size < end_off && !journaled; b++) {
+            journaled = overlay.count(b) || logged.count(b);
+        }
+        if (journaled) {
+            for (uint64_t b = offset / block_size; b * block_size < end_off; b++) {
+                uint64_t start = std::max<uint64_t>(offset, b * block_size);
+                uint64_t stop_at = std::min<uint64_t>(end_off, (b + 1) * block_size);
+                if (overlay.count(b) || logged.count(b)) record(start, src + (start - offset), stop_at - start);
+                else storage->write(start, src + (start - offset), stop_at - start);
+            }
+            if (handle.in) handle.wrote = true;
+            else { commit_wanted = true; commit_cv.notify_all(); }
+            return;
+        }
+    }
+    storage->write(offset, buf, len);
+}
+
+// Blocks in the overlay are copied under the lock. The rest are read in
+// place afterwards: with nothing pending for them they are current, and the
+// caller's filesystem locks keep anyone from writing the same bytes.
+void Journal::read(uint64_t offset, void* buf, size_t len) {
+    if (overlay_blocks.load() == 0) { storage->read(offset, buf, len); return; }
+    char* dst = static_cast<char*>(buf);
+    uint64_t end_off = offset + len;
+    std::vector<std::pair<uint64_t, uint64_t>> direct; // (offset, length)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (uint64_t b = offset / block_size; b * block_size < end_off; b++) {
+            uint64_t start = std::max<uint64_t>(offset, b * block_size);
+            uint64_t stop_at = std::min<uint64_t>(end_off, (b + 1) * block_size);
+            auto it = overlay.find(b);
+            if (it != overlay.end()) {
+                std::memcpy(dst + (start - offset), it->second.data.data() + (start - b * block_size), stop_at - start);
+            } else if (!direct.empty() && direct.back().first + direct.back().second == start) {
+                direct.back().second += stop_at - start;
+            } else {
+                direct.push_back({start, stop_at - start});
+            }
+        }
+    }
+    for (const auto& d : direct) storage->read(d.first, dst + (d.first - offset), d.second);
+}
+
+// Callers that bypass read() (sendfile from the image) check this first
+bool Journal::pending(uint64_t offset, uint64_t len) {
+    if (len == 0 || overlay_blocks.load() == 0) return false;
+    uint64_t first = offset / block_size;
+    uint64_t last = (offset + len - 1) / block_size;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (last - first >= overlay.size()) {
+        for (const auto& p : overlay) {
+            if (p.first >= first && p.first <= last) return true;
+        }
+        return false;
+    }
+    for (uint64_t b = first; b <= last; b++) {
+        if (overlay.count(b)) return true;
+    }
+    return false;
+}
+
+void Journal::afterCommit(uint64_t seq, Callback fn) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (seq > committed) {
+            waiting[seq].push_back(std::move(fn));
+            return;
+        }
+    }
+    fn();
+}
+
+JournalStats Journal::getStats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return stats;
+}
+
+uint64_t Journal::getUsedBytes() {
+    return head.load();
+}
@@ -0,0 +1,435 @@
+/**
+ * @file ofs_json.cpp
+ * @brief Single-pass JSON request parser and reusable response writer
+ * @location source/server/core/ofs_json.cpp
+ */
+
+#include "../../include/ofs_json.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// ============================================================================
+// 1. Request Parser
+// ============================================================================
+
+static const int MAX_NESTING = 32;
+
+static const char* skipWhitespace(const char* p, const char* e) {
+    while (p < e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+// p points just after an opening quote. Returns the closing quote or nullptr.
+// Fast path: memchr to the next quote; only if a backslash precedes it do we
+// walk byte by byte to honour escapes.
+static const char* scanString(const char* p, const char* e, bool& has_escapes) {
+    has_escapes = false;
+    while (p < e) {
+        const char* quote = static_cast<const char*>(std::memchr(p, '"', e - p));
+        if (!quote) return nullptr;
+        const char* slash = static_cast<const char*>(std::memchr(p, '\\', quote - p));
+        if (!slash) return quote;
+
+        has_escapes = true;
+        p = slash;
+        while (p < quote) {
+            if (*p == '\\') p += 2;
+            else p++;
+        }
+        if (p == quote) return quote; // Quote was not escaped
+        p = quote + 1;                // It was: keep looking
+    }
+    return nullptr;
+}
+
+class JsonParser {
+public:
+    explicit JsonParser(JsonRequest& r) : req(r) {}
+
+    // Parses one value starting at p. Object members are recorded as fields
+    // unless they sit inside an array. Returns the first byte after the value.
+    const char* value(const char* p, const char* e, int depth, bool record) {
+        if (depth > MAX_NESTING) return nullptr;
+        p = skipWhitespace(p, e);
+        if (p >= e) return nullptr;
+
+        if (*p == '{') return object(p + 1, e, depth + 1, record);
+        if (*p == '[') return array(p + 1, e, depth + 1);
+        if (*p == '"') {
+            const char* close = scanString(p + 1, e, last_escapes);
+            return close ? close + 1 : nullptr;
+        }
+        // Number / true / false / null: runs until a structural character
+        const char* start = p;
+        while (p < e && *p != ',' && *p != '}' && *p != ']' &&
+               *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+        return (p == start) ? nullptr : p;
+    }
+
+private:
+    JsonRequest& req;
+    bool last_escapes = false;  // Whether the string value() just scanned had escapes
+
+    const char* object(const char* p, const char* e, int depth, bool record) {
+        p = skipWhitespace(p, e);
+        if (p < e && *p == '}') return p + 1;
+
+        while (p < e) {
+            p = skipWhitespace(p, e);
+            if (p >= e || *p != '"') return nullptr;
+            bool key_escapes;
+            const char* key_end = scanString(p + 1, e, key_escapes);
+            if (!key_end) return nullptr;
+            std::string_view key(p + 1, key_end - p - 1);
+
+            p = skipWhitespace(key_end + 1, e);
+            if (p >= e || *p != ':') return nullptr;
+            p = skipWhitespace(p + 1, e);
+            if (p >= e) return nullptr;
+
+            const char* value_start = p;
+            const char* value_end = value(p, e, depth, record);
+            if (!value_end) return nullptr;
+
+            if (record && req.field_count < JsonRequest::MAX_FIELDS) {
+                JsonRequest::Field& f = req.fields[req.field_count++];
+                f.key = key;
+                f.is_string = (*value_start == '"');
+                f.has_escapes = f.is_string && last_escapes;
+                if (f.is_string) {
+                    f.value = std::string_view(value_start + 1, value_end - value_start - 2);
+                } else {
+                    f.value = std::string_view(value_start, value_end - value_start);
+                }
+            }
+
+            p = skipWhitespace(value_end, e);
+            if (p >= e) return nullptr;
+            if (*p == '}') return p + 1;
+            if (*p != ',') return nullptr;
+            p++;
+        }
+        return nullptr;
+    }
+
+    const char* array(const char* p, const char* e, int depth) {
+        p = skipWhitespace(p, e);
+        if (p < e && *p == ']') return p + 1;
+
+        while (p < e) {
+            p = value(p, e, depth, false);
+            if (!p) return nullptr;
+            p = skipWhitespace(p, e);
+            if (p >= e) return nullptr;
+            if (*p == ']') return p + 1;
+            if (*p != ',') return nullptr;
+            p++;
+        }
+        return nullptr;
+    }
+};
+
+bool JsonRequest::parse(std::string_view payload) {
+    field_count = 0;
+    end_offset = 0;
+    decoded.clear();
+
+    const char* begin = payload.data();
+    const char* e = begin + payload.size();
+    const char* p = skipWhitespace(begin, e);
+    if (p >= e || *p != '{') return false;
+
+    JsonParser parser(*this);
+    const char* stop = parser.value(p, e, 0, true);
+    if (!stop) {
+        field_count = 0;
+        return false;
+    }
+    end_offset = stop - begin;
+    return true;
+}
+
+const JsonRequest::Field* JsonRequest::find(std::string_view key) const {
+    for (int i = 0; i < field_count; i++) {
+        if (fields[i].key == key) return &fields[i];
+    }
+    return nullptr;
+}
+
+std::string_view JsonRequest::raw(std::string_view key) const {
+    const Field* f = find(key);
+    return f ? f->value : std::string_view();
+}
+
+bool JsonRequest::has(std::string_view key) const {
+    return find(key) != nullptr;
+}
+
+std::string_view JsonRequest::getString(std::string_view key) const {
+    const Field* f = find(key);
+    if (!f) return "";
+    if (!f->is_string || !f->has_escapes) return f->value;
+    decoded.push_back(jsonUnescape(f->value));
+    return decoded.back();
+}
+
+int64_t JsonRequest::getInt(std::string_view key, int64_t fallback) const {
+    const Field* f = find(key);
+    if (!f || f->value.empty()) return fallback;
+    char tmp[32];
+    size_t n = f->value.copy(tmp, sizeof(tmp) - 1);
+    tmp[n] = '\0';
+    char* stop = nullptr;
+    long long v = std::strtoll(tmp, &stop, 10);
+    return (stop == tmp) ? fallback : static_cast<int64_t>(v);
+}
+
+bool JsonRequest::getBool(std::string_view key, bool fallback) const {
+    const Field* f = find(key);
+    if (!f) return fallback;
+    if (f->value == "true" || f->value == "1") return true;
+    if (f->value == "false" || f->value == "0") return false;
+    return fallback;
+}
+
+size_t jsonObjectEnd(std::string_view buf, JsonScan& scan) {
+    for (; scan.pos < buf.size(); ++scan.pos) {
+        char c = buf[scan.pos];
+        if (scan.escape) {
+            scan.escape = false;
+        } else if (scan.in_string) {
+            if (c == '\\') scan.escape = true;
+            else if (c == '"') scan.in_string = false;
+        } else if (c == '"') {
+            scan.in_string = true;
+        } else if (c == '{') {
+            scan.depth++;
+        } else if (c == '}') {
+            if (--scan.depth == 0) return ++scan.pos;
+        }
+    }
+    return std::string_view::npos;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool readHex4(std::string_view s, size_t pos, uint32_t& out) {
+    if (pos + 4 > s.size()) return false;
+    out = 0;
+    for (size_t i = 0; i < 4; i++) {
+        int h = hexValue(s[pos + i]);
+        if (h < 0) return false;
+        out = (out << 4) | uint32_t(h);
+    }
+    return true;
+}
+
+static void appendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += char(cp);
+    } else if (cp < 0x800) {
+        out += char(0xC0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += char(0xE0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+    } else {
+        out += char(0xF0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3F));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+    }
+}
+
+std::string jsonUnescape(std::string_view raw) {
+    std::string out;
+    out.reserve(raw.size());
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw[i];
+        if (c != '\\' || i + 1 >= raw.size()) {
+            out += c;
+            continue;
+        }
+        char esc = raw[++i];
+        switch (esc) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!readHex4(raw, i + 1, cp)) { out += esc; break; }
+                i += 4;
+                // High surrogate followed by \uDC00-\uDFFF: combine into one code point
+                uint32_t low;
+                if (cp >= 0xD800 && cp <= 0xDBFF && i + 2 < raw.size() && raw[i + 1] == '\\' &&
+                    raw[i + 2] == 'u' && readHex4(raw, i + 3, low) && low >= 0xDC00 && low <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                }
+                appendUtf8(out, cp);
+                break;
+            }
+            default: out += esc; break; // \" \\ \/
+        }
+    }
+    return out;
+}
+
+
+// ============================================================================
+// 2. Response Writer
+// ============================================================================
+
+JsonWriter::JsonWriter(std::string& out) : buf(out), depth(0), after_key(false) {
+    first[0] = true;
+}
+
+void JsonWriter::separator() {
+    if (after_key) {
+        after_key = false;
+        return;
+    }
+    if (!first[depth]) buf += ", ";
+    first[depth] = false;
+}
+
+JsonWriter& JsonWriter::beginObject() {
+    separator();
+    buf += "{ ";
+    if (depth < MAX_DEPTH - 1) depth++;
+    first[depth] = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endObject() {
+    buf += " }";
+    if (depth > 0) depth--;
+    return *this;
+}
+
+JsonWriter& JsonWriter::beginArray() {
+    separator();
+    buf += '[';
+    if (depth < MAX_DEPTH - 1) depth++;
+    first[depth] = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endArray() {
+    buf += ']';
+    if (depth > 0) depth--;
+    return *this;
+}
+
+JsonWriter& JsonWriter::key(std::string_view k) {
+    separator();
+    buf += '"';
+    escape(k);
+    buf += "\": ";
+    after_key = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(std::string_view v) {
+    separator();
+    buf += '"';
+    escape(v);
+    buf += '"';
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(uint64_t v) {
+    separator();
+    char tmp[24];
+    int n = std::snprintf(tmp, sizeof(tmp), "%llu", static_cast<unsigned long long>(v));
+    buf.append(tmp, n);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(int64_t v) {
+    separator();
+    char tmp[24];
+    int n = std::snprintf(tmp, sizeof(tmp), "%lld", static_cast<long long>(v));
+    buf.append(tmp, n);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(double v) {
+    separator();
+    char tmp[32];
+    int n = std::snprintf(tmp, sizeof(tmp), "%.2f", v);
+    buf.append(tmp, n);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(bool v) {
+    separator();
+    buf += v ? "true" : "false";
+    return *this;
+}
+
+// Length of the well-formed UTF-8 sequence at p (lead byte >= 0x80), 0 if
+// there is none: bad lead or continuation byte, overlong form, surrogate, or
+// past U+10FFFF
+static size_t utf8Sequence(const unsigned char* p, size_t avail) {
+    unsigned char c = p[0];
+    size_t n;
+    uint32_t cp, min;
+    if (c >= 0xC2 && c <= 0xDF) { n = 2; cp = c & 0x1F; min = 0x80; }
+    else if ((c & 0xF0) == 0xE0) { n = 3; cp = c & 0x0F; min = 0x800; }
+    else if (c >= 0xF0 && c <= 0xF4) { n = 4; cp = c & 0x07; min = 0x10000; }
+    else return 0;
+    if (n > avail) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return 0;
+    return n;
+}
+
+// Copies runs of safe bytes in one append; only quotes, backslashes and
+// control characters are rewritten. Bytes that are not valid UTF-8 become
+// \u00XX, so the output always is.
+void JsonWriter::escape(std::string_view v) {
+    static const char* hex = "0123456789abcdef";
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(v.data());
+    size_t run = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+        if (c >= 0x80) {
+            size_t n = utf8Sequence(s + i, v.size() - i);
+            if (n) {
+                i += n - 1;
+                continue;
+            }
+        }
+
+        buf.append(v.data() + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': buf += "\\\""; break;
+            case '\\': buf += "\\\\"; break;
+            case '\n': buf += "\\n"; break;
+            case '\r': buf += "\\r"; break;
+            case '\t': buf += "\\t"; break;
+            case '\b': buf += "\\b"; break;
+            case '\f': buf += "\\f"; break;
+            default: { // Other control characters, and bytes that are not UTF-8
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                buf.append(u, 6);
+            }
+        }
+    }
+    buf.append(v.data() + run, v.size() - run);
+}
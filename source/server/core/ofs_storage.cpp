@@ -0,0 +1,122 @@
+/**
+ * @file ofs_storage.cpp
+ * @brief Storage backends for the .omni image (mmap and std::fstream)
+ * @location source/server/core/ofs_storage.cpp
+ */
+
+#include "../../include/ofs_storage.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::unique_ptr<StorageBackend> makeStorageBackend(const std::string& kind) {
+    if (kind == "mmap") return std::unique_ptr<StorageBackend>(new MmapBackend());
+    if (kind == "fstream") return std::unique_ptr<StorageBackend>(new FstreamBackend());
+    return nullptr;
+}
+
+// ============================================================================
+// MMAP
+// ============================================================================
+
+MmapBackend::~MmapBackend() {
+    if (base) {
+        msync(base, length, MS_SYNC);
+        munmap(base, length);
+    }
+    if (fd != -1) close(fd);
+}
+
+bool MmapBackend::open(const std::string& path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) return false;
+    length = static_cast<uint64_t>(st.st_size);
+
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "[STORAGE] mmap failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    base = static_cast<char*>(p);
+    return true;
+}
+
+// Out-of-range bytes read as zero and are dropped on write, like reading past
+// EOF with the fstream backend
+void MmapBackend::read(uint64_t offset, void* buf, size_t len) {
+    if (offset >= length) { std::memset(buf, 0, len); return; }
+    size_t n = std::min<uint64_t>(len, length - offset);
+    std::memcpy(buf, base + offset, n);
+    if (n < len) std::memset(static_cast<char*>(buf) + n, 0, len - n);
+}
+
+void MmapBackend::write(uint64_t offset, const void* buf, size_t len) {
+    if (offset >= length) return;
+    size_t n = std::min<uint64_t>(len, length - offset);
+    std::memcpy(base + offset, buf, n);
+}
+
+void MmapBackend::sync() {
+    if (base) msync(base, length, MS_SYNC);
+}
+
+// Linux tracks pages dirtied through a shared mapping, so fdatasync() writes
+// them back without msync() walking the whole mapping
+void MmapBackend::datasync() {
+    if (fd != -1) fdatasync(fd);
+}
+
+// ============================================================================
+// FSTREAM
+// ============================================================================
+
+FstreamBackend::~FstreamBackend() {
+    if (stream.is_open()) stream.close();
+    if (sync_fd != -1) close(sync_fd);
+}
+
+bool FstreamBackend::open(const std::string& path) {
+    stream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!stream.is_open()) return false;
+    stream.seekg(0, std::ios::end);
+    length = static_cast<uint64_t>(stream.tellg());
+    sync_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return true;
+}
+
+void FstreamBackend::read(uint64_t offset, void* buf, size_t len) {
+    std::lock_guard<std::mutex> lock(mtx);
+    stream.clear();
+    stream.seekg(offset);
+    stream.read(static_cast<char*>(buf), len);
+}
+
+void FstreamBackend::write(uint64_t offset, const void* buf, size_t len) {
+    std::lock_guard<std::mutex> lock(mtx);
+    stream.clear();
+    stream.seekp(offset);
+    stream.write(static_cast<const char*>(buf), len);
+}
+
+void FstreamBackend::flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    stream.flush();
+}
+
+void FstreamBackend::sync() {
+    flush();
+    if (sync_fd != -1) fsync(sync_fd);
+}
+
+void FstreamBackend::datasync() {
+    flush();
+    if (sync_fd != -1) fdatasync(sync_fd);
+}
@@ -0,0 +1,162 @@
+/**
+ * @file ofs_dedup.cpp
+ * @brief Block deduplication: fingerprints and the refcount table (region at dedup_table_offset)
+ * @location source/server/data_structures/ofs_dedup.cpp
+ */
+
+#include "../../include/ofs_dedup.hpp"
+#include <cstring>
+
+static const uint64_t MIX = 0x9E3779B97F4A7C15ULL;
+
+static inline uint64_t mixWord(uint64_t h, uint64_t w) {
+    h = (h ^ w) * MIX;
+    return h ^ (h >> 29);
+}
+
+uint64_t blockFingerprint(const char* data, size_t len) {
+    uint64_t lane[4] = {MIX, MIX + 1, MIX + 2, MIX + 3};
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        std::memcpy(w, data + i, sizeof(w));
+        for (int l = 0; l < 4; l++) lane[l] = mixWord(lane[l], w[l]);
+    }
+    for (; i < len; i += 8) {
+        uint64_t w = 0;
+        std::memcpy(&w, data + i, len - i < 8 ? len - i : 8);
+        lane[0] = mixWord(lane[0], w);
+    }
+    uint64_t h = len;
+    for (int l = 0; l < 4; l++) h = mixWord(h, lane[l]);
+    return (h ^ (h >> 32)) & FINGERPRINT_MASK;
+}
+
+// ============================================================================
+// DEDUP TABLE
+// ============================================================================
+
+DedupTable::DedupTable(uint64_t off, uint32_t n, ReadFn read, WriteFn write)
+    : offset(off), slots(n), readAt(std::move(read)), writeAt(std::move(write)) {}
+
+void DedupTable::load(bool from_v1) {
+    std::lock_guard<std::mutex> lock(mtx);
+    records.assign(slots, DedupRecord{});
+    if (slots) readAt(offset, records.data(), records.size() * sizeof(DedupRecord));
+    if (from_v1 && slots) {
+        upgradeV1(records.data(), records.size());
+        writeAt(offset, records.data(), records.size() * sizeof(DedupRecord));
+    }
+    by_fingerprint.clear();
+    by_block.clear();
+    free_slots.clear();
+    references = 0;
+    for (uint32_t i = slots; i-- > 0;) {
+        if (records[i].block() == 0) {
+            free_slots.push_back(i); // Lowest slot handed out first
+            continue;
+        }
+        by_fingerprint[records[i].fingerprint()] = i;
+        by_block[records[i].block()] = i;
+        references += records[i].refs;
+    }
+}
+
+void DedupTable::upgradeV1(DedupRecord* recs, size_t count) {
+    for (size_t i = 0; i < count; i++) recs[i].tag = recs[i].block_lo ? (recs[i].tag & FINGERPRINT_MASK) : 0;
+}
+
+void DedupTable::store(uint32_t slot) {
+    writeAt(slotOffset(slot), &records[slot], sizeof(DedupRecord));
+}
+
+void DedupTable::remove(uint32_t slot) {
+    auto fp = by_fingerprint.find(records[slot].fingerprint());
+    if (fp != by_fingerprint.end() && fp->second == slot) by_fingerprint.erase(fp);
+    by_block.erase(records[slot].block());
+    references -= records[slot].refs;
+    std::memset(&records[slot], 0, sizeof(DedupRecord));
+    store(slot);
+    free_slots.push_back(slot);
+}
+
+uint64_t DedupTable::share(uint64_t fingerprint, const SameFn& same) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = by_fingerprint.find(fingerprint & FINGERPRINT_MASK);
+    if (it == by_fingerprint.end()) return 0;
+    DedupRecord& r = records[it->second];
+    if (!same(r.block())) return 0; // A collision: the new block stays unshared
+    r.refs++;
+    references++;
+    store(it->second);
+    return r.block();
+}
+
+void DedupTable::add(uint64_t block, uint64_t fingerprint) {
+    std::lock_guard<std::mutex> lock(mtx);
+    fingerprint &= FINGERPRINT_MASK;
+    if (free_slots.empty() || by_fingerprint.count(fingerprint) || by_block.count(block)) return;
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    records[slot] = {static_cast<uint32_t>(block), 1, ((block >> 32) << 48) | fingerprint};
+    by_fingerprint[fingerprint] = slot;
+    by_block[block] = slot;
+    references++;
+    store(slot);
+}
+
+void DedupTable::release(uint64_t start, uint64_t count, std::vector<Extent>& unreferenced) {
+    auto drop = [&](uint64_t b) {
+        Extent* last = unreferenced.empty() ? nullptr : &unreferenced.back();
+        if (last && last->start + last->count == b) last->count++;
+        else unreferenced.push_back({b, 1});
+    };
+    std::lock_guard<std::mutex> lock(mtx);
+    if (by_block.empty()) {
+        unreferenced.push_back({start, count});
+        return;
+    }
+    for (uint64_t b = start; b < start + count; b++) {
+        auto it = by_block.find(b);
+        if (it == by_block.end()) {
+            drop(b);
+            continue;
+        }
+        uint32_t slot = it->second;
+        if (records[slot].refs <= 1) {
+            remove(slot);
+            drop(b);
+        } else {
+            records[slot].refs--;
+            references--;
+            store(slot);
+        }
+    }
+}
+
+bool DedupTable::contains(uint64_t block) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return by_block.count(block) != 0;
+}
+
+uint32_t DedupTable::forget(const std::function<bool(uint64_t)>& keep) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint32_t removed = 0;
+    for (uint32_t i = 0; i < slots; i++) {
+        if (records[i].block() != 0 && !keep(records[i].block())) {
+            remove(i);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+uint32_t DedupTable::getCount() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return slots - free_slots.size();
+}
+
+uint64_t DedupTable::getReferences() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return references;
+}
@@ -0,0 +1,534 @@
+/**
+ * @file ofs_directory.cpp
+ * @brief On-disk directories (name -> inode records, linear or hashed) and inode records
+ * @location source/server/data_structures/ofs_directory.cpp
+ */
+
+#include "../../include/ofs_directory.hpp"
+#include <cstring>
+#include <algorithm>
+
+static const char DIR_MAGIC[8] = {'\0', 'H', 'D', 'I', 'R', 'v', '2', '\0'};
+static const char DIR_MAGIC_V1[8] = {'\0', 'H', 'D', 'I', 'R', 'v', '1', '\0'};
+
+// ============================================================================
+// INODE RECORDS
+// ============================================================================
+
+DiskInode toDiskInode(const FileEntry& entry) {
+    DiskInode d;
+    std::memset(&d, 0, sizeof(d));
+    d.type = entry.type;
+    d.permissions = entry.permissions;
+    d.size = entry.size;
+    d.created_time = entry.created_time;
+    d.modified_time = entry.modified_time;
+    std::memcpy(d.owner, entry.owner, sizeof(d.owner));
+    d.inode = entry.inode;
+    d.parent_inode = entry.parent_inode;
+    std::memcpy(d.reserved, entry.reserved, sizeof(d.reserved));
+    return d;
+}
+
+FileEntry fromDiskInode(std::string_view name, const DiskInode& d) {
+    FileEntry e(std::string(name), static_cast<EntryType>(d.type), d.size, d.permissions,
+                std::string(d.owner, strnlen(d.owner, sizeof(d.owner))), d.inode, d.parent_inode);
+    e.created_time = d.created_time;
+    e.modified_time = d.modified_time;
+    std::memcpy(e.reserved, d.reserved, sizeof(e.reserved));
+    return e;
+}
+
+
+// ============================================================================
+// RECORD BLOCKS
+// A DirLeafHeader, then 'used' bytes of records and holes. Shared by linear
+// directories and the leaves of hashed ones.
+// ============================================================================
+
+static size_t recordLen(size_t name_len) {
+    return (sizeof(DirRecord) + name_len + 7) & ~static_cast<size_t>(7);
+}
+
+static DirLeafHeader leafHeader(const std::vector<char>& buf) {
+    DirLeafHeader lh;
+    std::memcpy(&lh, buf.data(), sizeof(lh));
+    return lh;
+}
+
+static void eachRecord(const std::vector<char>& buf, const DirectoryStore::RecordFn& fn) {
+    DirLeafHeader lh = leafHeader(buf);
+    size_t end = std::min<size_t>(sizeof(lh) + lh.used, buf.size());
+    for (size_t pos = sizeof(lh); pos + sizeof(DirRecord) <= end;) {
+        DirRecord r;
+        std::memcpy(&r, buf.data() + pos, sizeof(r));
+        if (r.rec_len == 0) break;
+        if (r.inode != 0) fn(std::string_view(buf.data() + pos + sizeof(r), r.name_len), r.inode, static_cast<EntryType>(r.type));
+        pos += r.rec_len;
+    }
+}
+
+// Appends a record. Returns its offset, or 0 when the block is full.
+static size_t appendRecord(std::vector<char>& buf, std::string_view name, uint32_t inode, EntryType type) {
+    DirLeafHeader lh = leafHeader(buf);
+    size_t len = recordLen(name.size());
+    size_t pos = sizeof(lh) + lh.used;
+    if (pos + len > buf.size()) return 0;
+
+    DirRecord r = {inode, static_cast<uint8_t>(type), static_cast<uint8_t>(name.size()), static_cast<uint16_t>(len)};
+    std::memset(buf.data() + pos, 0, len);
+    std::memcpy(buf.data() + pos, &r, sizeof(r));
+    std::memcpy(buf.data() + pos + sizeof(r), name.data(), name.size());
+    lh.used += len;
+    lh.count++;
+    std::memcpy(buf.data(), &lh, sizeof(lh));
+    return pos;
+}
+
+// ============================================================================
+// DIRECTORY STORE
+// ============================================================================
+
+DirectoryStore::DirectoryStore(uint32_t block_size, BlockManager* block_manager, ReadFn read, WriteFn write)
+    : block_size(block_size), blocks(block_manager), readAt(std::move(read)), writeAt(std::move(write)) {}
+
+// FNV-1a over the name bytes
+uint32_t DirectoryStore::hashName(std::string_view name) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Deepest table that still fits behind the root block's table pointers
+uint32_t DirectoryStore::maxDepth(uint32_t w) const {
+    uint32_t d = 0;
+    while (d < 31 && (((uint64_t)1 << (d + 1)) + tableSlots(w) - 1) / tableSlots(w) <= rootSlots(w)) d++;
+    return d;
+}
+
+uint32_t DirectoryStore::ptrBytes(const DirIndexHeader& hdr) {
+    return std::memcmp(hdr.magic, DIR_MAGIC_V1, sizeof(DIR_MAGIC_V1)) == 0 ? sizeof(uint32_t) : sizeof(uint64_t);
+}
+
+void DirectoryStore::readPtrs(uint64_t offset, uint32_t n, uint32_t w, uint64_t* out) {
+    if (w == sizeof(uint64_t)) {
+        readAt(offset, out, (size_t)n * w);
+        return;
+    }
+    std::vector<uint32_t> narrow(n);
+    readAt(offset, narrow.data(), (size_t)n * w);
+    std::copy(narrow.begin(), narrow.end(), out);
+}
+
+void DirectoryStore::writePtrs(uint64_t offset, const uint64_t* ptrs, uint32_t n, uint32_t w) {
+    if (w == sizeof(uint64_t)) {
+        writeAt(offset, ptrs, (size_t)n * w);
+        return;
+    }
+    std::vector<uint32_t> narrow(ptrs, ptrs + n);
+    writeAt(offset, narrow.data(), (size_t)n * w);
+}
+
+// A new directory's index is known without reading it back
+void DirectoryStore::format(uint64_t dir_block) {
+    std::vector<char> zero(block_size, 0);
+    writeAt(at(dir_block), zero.data(), zero.size());
+    std::lock_guard<std::mutex> lock(index_mtx);
+    roots[dir_block] = RootIndex();
+    leaves[dir_block] = LeafIndex();
+}
+
+bool DirectoryStore::readHeader(uint64_t dir_block, DirIndexHeader& hdr) {
+    readAt(at(dir_block), &hdr, sizeof(hdr));
+    return std::memcmp(hdr.magic, DIR_MAGIC, sizeof(DIR_MAGIC)) == 0 ||
+           std::memcmp(hdr.magic, DIR_MAGIC_V1, sizeof(DIR_MAGIC_V1)) == 0;
+}
+
+bool DirectoryStore::isHashed(uint64_t dir_block) {
+    DirIndexHeader hdr;
+    return readHeader(dir_block, hdr);
+}
+
+// The table block list, and the 2^depth leaf pointers they hold
+void DirectoryStore::readTable(uint64_t dir_block, const DirIndexHeader& hdr,
+                               std::vector<uint64_t>& tables, std::vector<uint64_t>& ptrs) {
+    uint32_t w = ptrBytes(hdr), per = tableSlots(w);
+    uint32_t n = 1u << hdr.depth;
+    tables.resize((n + per - 1) / per);
+    readPtrs(at(dir_block) + sizeof(DirIndexHeader), tables.size(), w, tables.data());
+    ptrs.resize(n);
+    for (uint32_t t = 0; t < tables.size(); t++) {
+        readPtrs(at(tables[t]), std::min(per, n - t * per), w, ptrs.data() + t * per);
+    }
+}
+
+uint64_t DirectoryStore::tableGet(uint64_t dir_block, const DirIndexHeader& hdr, uint32_t i) {
+    uint32_t w = ptrBytes(hdr);
+    uint64_t tb = 0, leaf = 0;
+    readPtrs(at(dir_block) + sizeof(DirIndexHeader) + (uint64_t)(i / tableSlots(w)) * w, 1, w, &tb);
+    readPtrs(at(tb) + (uint64_t)(i % tableSlots(w)) * w, 1, w, &leaf);
+    return leaf;
+}
+
+void DirectoryStore::tableSet(uint64_t dir_block, const DirIndexHeader& hdr, uint32_t i, uint64_t leaf) {
+    uint32_t w = ptrBytes(hdr);
+    uint64_t tb = 0;
+    readPtrs(at(dir_block) + sizeof(DirIndexHeader) + (uint64_t)(i / tableSlots(w)) * w, 1, w, &tb);
+    writePtrs(at(tb) + (uint64_t)(i % tableSlots(w)) * w, &leaf, 1, w);
+}
+
+uint64_t DirectoryStore::allocBlock() {
+    uint64_t b = blocks->allocateBlocks(1);
+    if (b != 0) format(b);
+    return b;
+}
+
+// ============================================================================
+// INDEXES
+// ============================================================================
+
+DirectoryStore::RootIndex& DirectoryStore::rootIndex(uint64_t dir_block) {
+    {
+        std::lock_guard<std::mutex> lock(index_mtx);
+        auto it = roots.find(dir_block);
+        if (it != roots.end()) return it->second;
+    }
+    RootIndex root;
+    root.hashed = readHeader(dir_block, root.hdr);
+    if (root.hashed) {
+        std::vector<uint64_t> tables;
+        readTable(dir_block, root.hdr, tables, root.table);
+    }
+    std::lock_guard<std::mutex> lock(index_mtx);
+    return roots.emplace(dir_block, std::move(root)).first->second;
+}
+
+DirectoryStore::LeafIndex& DirectoryStore::leafIndex(uint64_t block) {
+    {
+        std::lock_guard<std::mutex> lock(index_mtx);
+        auto it = leaves.find(block);
+        if (it != leaves.end()) return it->second;
+    }
+    std::vector<char> buf(block_size);
+    readAt(at(block), buf.data(), buf.size());
+    LeafIndex leaf;
+    leaf.hdr = leafHeader(buf);
+    size_t end = std::min<size_t>(sizeof(DirLeafHeader) + leaf.hdr.used, buf.size());
+    for (size_t pos = sizeof(DirLeafHeader); pos + sizeof(DirRecord) <= end;) {
+        DirRecord r;
+        std::memcpy(&r, buf.data() + pos, sizeof(r));
+        if (r.rec_len == 0) break;
+        if (r.inode == 0) {
+            leaf.holes.push_back({static_cast<uint32_t>(pos), r.rec_len});
+        } else {
+            leaf.names[std::string(buf.data() + pos + sizeof(r), r.name_len)] = {static_cast<uint32_t>(pos), r.rec_len, r.inode};
+        }
+        pos += r.rec_len;
+    }
+    std::lock_guard<std::mutex> lock(index_mtx);
+    return leaves.emplace(block, std::move(leaf)).first->second;
+}
+
+uint64_t DirectoryStore::leafOf(const RootIndex& root, uint64_t dir_block, std::string_view name) const {
+    if (!root.hashed) return dir_block;
+    return root.table[hashName(name) & ((1u << root.hdr.depth) - 1)];
+}
+
+void DirectoryStore::forget(uint64_t block) {
+    std::lock_guard<std::mutex> lock(index_mtx);
+    roots.erase(block);
+    leaves.erase(block);
+}
+
+void DirectoryStore::invalidate() {
+    std::lock_guard<std::mutex> lock(index_mtx);
+    roots.clear();
+    leaves.clear();
+}
+
+// --- LOOKUP ---
+bool DirectoryStore::lookup(uint64_t dir_block, std::string_view name, uint32_t& inode) {
+    RootIndex& root = rootIndex(dir_block);
+    LeafIndex& leaf = leafIndex(leafOf(root, dir_block, name));
+    auto it = leaf.names.find(std::string(name));
+    if (it == leaf.names.end()) return false;
+    inode = it->second.inode;
+    return true;
+}
+
+// --- STORE ---
+// An existing name is repointed in place. A new one takes the smallest hole
+// that fits, else the end of the records; only a full block reads anything.
+bool DirectoryStore::store(uint64_t dir_block, std::string_view name, uint32_t inode, EntryType type) {
+    if (name.empty() || name.size() >= sizeof(FileEntry::name)) return false;
+    uint32_t len = recordLen(name.size());
+
+    for (;;) {
+        RootIndex& root = rootIndex(dir_block);
+        uint64_t b = leafOf(root, dir_block, name);
+        LeafIndex& leaf = leafIndex(b);
+        DirRecord r = {inode, static_cast<uint8_t>(type), static_cast<uint8_t>(name.size()), 0};
+
+        auto it = leaf.names.find(std::string(name));
+        if (it != leaf.names.end()) {
+            r.rec_len = it->second.rec_len;
+            it->second.inode = inode;
+            writeAt(at(b) + it->second.pos, &r, sizeof(r));
+            return true;
+        }
+
+        size_t best = leaf.holes.size();
+        for (size_t i = 0; i < leaf.holes.size(); i++) {
+            if (leaf.holes[i].second >= len &&
+                (best == leaf.holes.size() || leaf.holes[i].second < leaf.holes[best].second)) best = i;
+        }
+        uint32_t pos, room;
+        if (best < leaf.holes.size()) {
+            pos = leaf.holes[best].first;
+            room = leaf.holes[best].second;
+            leaf.holes.erase(leaf.holes.begin() + best);
+        } else if (sizeof(DirLeafHeader) + leaf.hdr.used + len <= block_size) {
+            pos = sizeof(DirLeafHeader) + leaf.hdr.used;
+            room = len;
+            leaf.hdr.used += len;
+        } else {
+            DirIndexHeader hdr = root.hdr; // Growth drops root's index
+            if (!root.hashed ? !convert(dir_block) : !split(dir_block, hdr, hashName(name))) return false;
+            continue;
+        }
+
+        // The record, then what is left of the hole as a smaller hole (or
+        // slack at the end of this record when too small for one)
+        uint32_t rest = room - len;
+        r.rec_len = static_cast<uint16_t>(rest >= recordLen(1) ? len : room);
+        std::vector<char> rec(rest >= recordLen(1) ? len + sizeof(DirRecord) : len, 0);
+        std::memcpy(rec.data(), &r, sizeof(r));
+        std::memcpy(rec.data() + sizeof(r), name.data(), name.size());
+        if (rest >= recordLen(1)) {
+            DirRecord hole = {0, 0, 0, static_cast<uint16_t>(rest)};
+            std::memcpy(rec.data() + len, &hole, sizeof(hole));
+            leaf.holes.push_back({pos + len, rest});
+        }
+        writeAt(at(b) + pos, rec.data(), rec.size());
+        leaf.names[std::string(name)] = {pos, r.rec_len, inode};
+        leaf.hdr.count++;
+        writeAt(at(b), &leaf.hdr, sizeof(DirLeafHeader));
+        if (root.hashed) {
+            root.hdr.entries++;
+            writeAt(at(dir_block), &root.hdr, sizeof(DirIndexHeader));
+        }
+        return true;
+    }
+}
+
+// --- REMOVE ---
+// The record becomes a hole, merged with holes on either side. Removing the
+// last record gives its bytes (and a hole right before it) back to the block.
+bool DirectoryStore::remove(uint64_t dir_block, std::string_view name) {
+    RootIndex& root = rootIndex(dir_block);
+    uint64_t b = leafOf(root, dir_block, name);
+    LeafIndex& leaf = leafIndex(b);
+    auto it = leaf.names.find(std::string(name));
+    if (it == leaf.names.end()) return false;
+
+    uint32_t pos = it->second.pos, len = it->second.rec_len;
+    leaf.names.erase(it);
+    leaf.hdr.count--;
+    for (size_t i = 0; i < leaf.holes.size();) {
+        if (leaf.holes[i].first + leaf.holes[i].second == pos || pos + len == leaf.holes[i].first) {
+            pos = std::min(pos, leaf.holes[i].first);
+            len += leaf.holes[i].second;
+            leaf.holes.erase(leaf.holes.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    if (pos + len == sizeof(DirLeafHeader) + leaf.hdr.used) {
+        leaf.hdr.used -= len;
+    } else {
+        DirRecord hole = {0, 0, 0, static_cast<uint16_t>(len)};
+        writeAt(at(b) + pos, &hole, sizeof(hole));
+        leaf.holes.push_back({pos, len});
+    }
+    writeAt(at(b), &leaf.hdr, sizeof(DirLeafHeader));
+    if (root.hashed) {
+        root.hdr.entries--;
+        writeAt(at(dir_block), &root.hdr, sizeof(DirIndexHeader));
+    }
+    return true;
+}
+
+// --- ITERATION ---
+void DirectoryStore::forEach(uint64_t dir_block, const RecordFn& fn) {
+    std::vector<uint64_t> leaves;
+    DirIndexHeader hdr;
+    if (readHeader(dir_block, hdr)) {
+        indexBlocks(dir_block, leaves);
+        uint32_t per = tableSlots(ptrBytes(hdr));
+        uint32_t table_blocks = ((1u << hdr.depth) + per - 1) / per;
+        leaves.erase(leaves.begin(), leaves.begin() + table_blocks);
+    } else {
+        leaves.push_back(dir_block);
+    }
+
+    std::vector<char> buf(block_size);
+    for (uint64_t b : leaves) {
+        readAt(at(b), buf.data(), buf.size());
+        eachRecord(buf, fn);
+    }
+}
+
+void DirectoryStore::forEachLegacy(uint64_t dir_block, const std::function<void(const FileEntry&)>& fn) {
+    std::vector<uint64_t> leaves;
+    DirIndexHeader hdr;
+    uint64_t first = 0;
+    if (readHeader(dir_block, hdr)) {
+        indexBlocks(dir_block, leaves);
+        uint32_t per = tableSlots(ptrBytes(hdr));
+        uint32_t table_blocks = ((1u << hdr.depth) + per - 1) / per;
+        leaves.erase(leaves.begin(), leaves.begin() + table_blocks);
+        first = sizeof(DirLeafHeader);
+    } else {
+        leaves.push_back(dir_block);
+    }
+
+    std::vector<char> buf(block_size);
+    uint32_t slots = (block_size - first) / sizeof(FileEntry);
+    for (uint64_t b : leaves) {
+        readAt(at(b), buf.data(), buf.size());
+        for (uint32_t i = 0; i < slots; i++) {
+            const FileEntry* e = reinterpret_cast<const FileEntry*>(buf.data() + first + i * sizeof(FileEntry));
+            if (e->name[0] != '\0') fn(*e);
+        }
+    }
+}
+
+// Table blocks first, then each distinct leaf once
+void DirectoryStore::indexBlocks(uint64_t dir_block, std::vector<uint64_t>& out) {
+    DirIndexHeader hdr;
+    if (!readHeader(dir_block, hdr)) return;
+
+    std::vector<uint64_t> tables, ptrs;
+    readTable(dir_block, hdr, tables, ptrs);
+    std::sort(ptrs.begin(), ptrs.end());
+    ptrs.erase(std::unique(ptrs.begin(), ptrs.end()), ptrs.end());
+
+    out.insert(out.end(), tables.begin(), tables.end());
+    out.insert(out.end(), ptrs.begin(), ptrs.end());
+}
+
+void DirectoryStore::release(uint64_t dir_block) {
+    std::vector<uint64_t> owned;
+    indexBlocks(dir_block, owned);
+    for (uint64_t b : owned) {
+        blocks->freeBlocks(b, 1);
+        forget(b);
+    }
+    forget(dir_block);
+}
+
+// ============================================================================
+// GROWTH
+// ============================================================================
+
+// Rewrites a full linear block as a depth-0 index whose one leaf gets the old
+// records back (a leaf holds exactly what a linear block does).
+bool DirectoryStore::convert(uint64_t dir_block) {
+    std::vector<char> old(block_size);
+    readAt(at(dir_block), old.data(), old.size());
+
+    uint64_t table = allocBlock();
+    uint64_t leaf = table ? allocBlock() : 0;
+    if (!leaf) {
+        if (table) blocks->freeBlocks(table, 1);
+        return false;
+    }
+    writeAt(at(leaf), old.data(), old.size());
+    writeAt(at(table), &leaf, sizeof(leaf));
+
+    DirIndexHeader hdr;
+    std::memcpy(hdr.magic, DIR_MAGIC, sizeof(DIR_MAGIC));
+    hdr.depth = 0;
+    hdr.entries = leafHeader(old).count;
+    format(dir_block);
+    writeAt(at(dir_block) + sizeof(hdr), &table, sizeof(table));
+    writeAt(at(dir_block), &hdr, sizeof(hdr));
+    forget(dir_block);
+    forget(table);
+    forget(leaf);
+    return true;
+}
+
+// 2^depth -> 2^(depth+1) pointers: the upper half repeats the lower half
+bool DirectoryStore::doubleTable(uint64_t dir_block, DirIndexHeader& hdr) {
+    uint32_t w = ptrBytes(hdr);
+    uint32_t n = 1u << hdr.depth;
+    uint32_t tb = tableSlots(w);
+    uint64_t first_table = 0;
+    readPtrs(at(dir_block) + sizeof(DirIndexHeader), 1, w, &first_table);
+
+    if (2 * n <= tb) {
+        std::vector<char> ptrs((size_t)n * w); // Copied as stored, whatever the width
+        readAt(at(first_table), ptrs.data(), ptrs.size());
+        writeAt(at(first_table) + ptrs.size(), ptrs.data(), ptrs.size());
+    } else {
+        // n is a whole number of table blocks: copy each into a new block
+        uint32_t old_blocks = n / tb;
+        std::vector<uint64_t> tables(old_blocks), added;
+        readPtrs(at(dir_block) + sizeof(DirIndexHeader), old_blocks, w, tables.data());
+        for (uint32_t k = 0; k < old_blocks; k++) {
+            uint64_t nb = allocBlock();
+            if (!nb) {
+                for (uint64_t b : added) blocks->freeBlocks(b, 1);
+                return false;
+            }
+            added.push_back(nb);
+        }
+        std::vector<char> buf(block_size);
+        for (uint32_t k = 0; k < old_blocks; k++) {
+            readAt(at(tables[k]), buf.data(), buf.size());
+            writeAt(at(added[k]), buf.data(), buf.size());
+        }
+        writePtrs(at(dir_block) + sizeof(DirIndexHeader) + (uint64_t)old_blocks * w, added.data(), added.size(), w);
+        for (uint64_t b : added) forget(b);
+    }
+    hdr.depth++;
+    writeAt(at(dir_block), &hdr, sizeof(hdr));
+    forget(dir_block);
+    return true;
+}
+
+// Splits the leaf 'hash' maps to on its next hash bit
+bool DirectoryStore::split(uint64_t dir_block, DirIndexHeader& hdr, uint32_t hash) {
+    uint64_t leaf = tableGet(dir_block, hdr, hash & ((1u << hdr.depth) - 1));
+    std::vector<char> buf(block_size);
+    readAt(at(leaf), buf.data(), buf.size());
+    uint32_t ld = leafHeader(buf).depth;
+
+    if (ld == hdr.depth && (hdr.depth >= maxDepth(ptrBytes(hdr)) || !doubleTable(dir_block, hdr))) return false;
+    uint64_t nb = allocBlock();
+    if (!nb) return false;
+
+    std::vector<char> low(block_size, 0), high(block_size, 0);
+    DirLeafHeader lh = {ld + 1, 0, 0, 0};
+    std::memcpy(low.data(), &lh, sizeof(lh));
+    std::memcpy(high.data(), &lh, sizeof(lh));
+    eachRecord(buf, [&](std::string_view name, uint32_t inode, EntryType type) {
+        appendRecord(((hashName(name) >> ld) & 1) ? high : low, name, inode, type);
+    });
+    writeAt(at(nb), high.data(), high.size());
+    writeAt(at(leaf), low.data(), low.size());
+
+    // Every table slot that shares the old leaf's low bits and has bit ld set
+    uint32_t step = 1u << (ld + 1);
+    for (uint32_t i = (hash & ((1u << ld) - 1)) | (1u << ld); i < (1u << hdr.depth); i += step) {
+        tableSet(dir_block, hdr, i, nb);
+    }
+    forget(dir_block);
+    forget(leaf);
+    forget(nb);
+    return true;
+}
@@ -1,6 +1,6 @@
 /**
  * @file ofs_structures.cpp
- * @brief Implementation of AVL Tree, N-ary Tree, and Bitmap
+ * @brief Implementation of AVL Tree, N-ary Tree, Bitmap, and Slot Map
  * @location source/server/data_structures/ofs_structures.cpp
  */
 
@@ -19,6 +19,11 @@ UserAVLTree::~UserAVLTree() {
     destroyTree(root);
 }
 
+void UserAVLTree::clear() {
+    destroyTree(root);
+    root = nullptr;
+}
+
 void UserAVLTree::destroyTree(UserNode* node) {
     if (node) {
         destroyTree(node->left);
@@ -170,7 +175,7 @@ std::vector<UserInfo> UserAVLTree::getAllUsers() {
 // 2. N-ary Tree Implementation (File System Hierarchy)
 // ============================================================================
 
-FileSystemTree::FileSystemTree() : root(nullptr), next_inode_counter(1) {}
+FileSystemTree::FileSystemTree() : root(nullptr), next_inode_counter(1), loaded_dirs(0) {}
 
 FileSystemTree::~FileSystemTree() {
     destroyTree(root);
@@ -194,15 +199,36 @@ FSNode* FileSystemTree::getRoot() {
     return root;
 }
 
+// Double-checked: once 'loaded' is seen true the children are complete
+void FileSystemTree::ensureLoaded(FSNode* dir) {
+    if (!dir || dir->loaded.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(load_mutex);
+    if (dir->loaded.load(std::memory_order_relaxed)) return;
+
+    if (loader) {
+        for (const FileEntry& entry : loader(dir->metadata)) {
+            FSNode* child = attach(dir, entry);
+            if (child && entry.getType() == EntryType::DIRECTORY) child->loaded = false;
+        }
+    }
+    loaded_dirs++;
+    dir->loaded.store(true, std::memory_order_release);
+}
+
+// Links a node under parent (no loading, no inode assignment)
+FSNode* FileSystemTree::attach(FSNode* parent, const FileEntry& entry) {
+    if (parent->by_name.count(entry.name)) return nullptr; // A damaged directory listing a name twice
+    FSNode* node = new FSNode(entry, parent);
+    parent->children.push_back(node);
+    parent->by_name[node->metadata.name] = node;
+    return node;
+}
+
 // Helper to find a child node by name
 FSNode* FileSystemTree::findChild(FSNode* parent, std::string name) {
     if (!parent) return nullptr;
-    for (FSNode* child : parent->children) {
-        if (std::string(child->metadata.name) == name) {
-            return child;
-        }
-    }
-    return nullptr;
+    auto it = parent->by_name.find(name);
+    return it == parent->by_name.end() ? nullptr : it->second;
 }
 
 // Path Resolution: Turns "/home/docs/file.txt" into the corresponding Node*
@@ -222,6 +248,7 @@ FSNode* FileSystemTree::resolvePath(std::string path) {
     while (std::getline(ss, segment, '/')) {
         if (segment.empty()) continue; // Handle double slashes or trailing slash
         
+        ensureLoaded(current);
         FSNode* next = findChild(current, segment);
         if (!next) return nullptr; // Path doesn't exist
         current = next;
@@ -232,39 +259,37 @@ FSNode* FileSystemTree::resolvePath(std::string path) {
 
 FSNode* FileSystemTree::addChild(FSNode* parent, FileEntry entry) {
     if (!parent) return nullptr;
+    ensureLoaded(parent);
     
     // Check if child with same name already exists
     if (findChild(parent, std::string(entry.name))) {
         return nullptr; // Error: Already exists
     }
 
-    // Set Inode and Parent Inode
-    entry.inode = getNextInode();
+    // Set Inode (unless the caller allocated one from the inode table) and Parent Inode
+    if (entry.inode == 0) entry.inode = getNextInode();
     entry.parent_inode = parent->metadata.inode;
 
-    FSNode* newNode = new FSNode(entry, parent);
-    parent->children.push_back(newNode);
-    return newNode;
+    return attach(parent, entry);
 }
 
 bool FileSystemTree::removeChild(FSNode* parent, std::string name) {
     if (!parent) return false;
 
-    auto it = parent->children.begin();
-    while (it != parent->children.end()) {
-        if (std::string((*it)->metadata.name) == name) {
-            // Found it. Check if it's a directory, ensure it's empty
-            if ((*it)->metadata.getType() == EntryType::DIRECTORY && !(*it)->children.empty()) {
-                return false; // Error: Directory not empty
-            }
-            
-            delete *it; // Free memory
-            parent->children.erase(it); // Remove from vector
-            return true;
-        }
-        ++it;
+    ensureLoaded(parent);
+    FSNode* node = findChild(parent, name);
+    if (!node) return false; // Not found
+    ensureLoaded(node);
+
+    // Check if it's a directory, ensure it's empty
+    if (node->metadata.getType() == EntryType::DIRECTORY && !node->children.empty()) {
+        return false; // Error: Directory not empty
     }
-    return false; // Not found
+
+    parent->by_name.erase(name);
+    parent->children.erase(std::find(parent->children.begin(), parent->children.end(), node));
+    delete node; // Free memory
+    return true;
 }
 
 std::vector<FileEntry> FileSystemTree::listDirectory(std::string path) {
@@ -272,6 +297,7 @@ std::vector<FileEntry> FileSystemTree::listDirectory(std::string path) {
     std::vector<FileEntry> entries;
     
     if (node && node->metadata.getType() == EntryType::DIRECTORY) {
+        ensureLoaded(node);
         for (FSNode* child : node->children) {
             entries.push_back(child->metadata);
         }
@@ -284,65 +310,387 @@ std::vector<FileEntry> FileSystemTree::listDirectory(std::string path) {
 // 3. Bitmap Implementation (Free Space)
 // ============================================================================
 
-BlockManager::BlockManager(uint32_t num_blocks) : total_blocks(num_blocks), used_blocks_count(0) {
-    // Initialize all blocks as free (false)
-    bitmap.resize(num_blocks, false); 
+BlockManager::BlockManager(uint64_t num_blocks, AllocPolicy alloc_policy)
+    : total_blocks(num_blocks), used_blocks_count(0), policy(alloc_policy) {
+    // Initialize all blocks as free (false): one free run covering the image.
+    // Padding bits past the last block read as used so scans never return them.
+    words.assign(bitmapBytes(num_blocks) / 8, 0);
+    if (num_blocks % 64) words.back() = ~0ULL << (num_blocks % 64);
+    if (num_blocks > 0) addFreeExtent(0, num_blocks);
     
     // Always mark block 0 as used (it's the Header)
     markUsed(0, 1);
 }
 
+// --- Word-level bitmap ---
+uint64_t BlockManager::nextFree(uint64_t from, uint64_t limit) const {
+    while (from < limit) {
+        size_t w = from >> 6;
+        uint64_t free_bits = ~words[w] & (~0ULL << (from & 63));
+        if (free_bits) return std::min<uint64_t>(((uint64_t)w << 6) + __builtin_ctzll(free_bits), limit);
+        from = ((uint64_t)w + 1) << 6; // Whole word used: skip it
+    }
+    return limit;
+}
+
+uint64_t BlockManager::nextUsed(uint64_t from, uint64_t limit) const {
+    while (from < limit) {
+        size_t w = from >> 6;
+        uint64_t used_bits = words[w] & (~0ULL << (from & 63));
+        if (used_bits) return std::min<uint64_t>(((uint64_t)w << 6) + __builtin_ctzll(used_bits), limit);
+        from = ((uint64_t)w + 1) << 6; // Whole word free: skip it
+    }
+    return limit;
+}
+
+void BlockManager::setRange(uint64_t start, uint64_t count, bool used) {
+    if (count == 0) return;
+    uint64_t end = start + count;
+    size_t first = start >> 6, last = (end - 1) >> 6;
+    for (size_t w = first; w <= last; w++) {
+        uint32_t lo = (w == first) ? (start & 63) : 0;
+        uint32_t hi = (w == last) ? ((end - 1) & 63) + 1 : 64;
+        uint64_t mask = (hi == 64 ? ~0ULL : ((1ULL << hi) - 1)) & (~0ULL << lo);
+        if (used) words[w] |= mask;
+        else words[w] &= ~mask;
+    }
+    if (persist) persist((uint64_t)first * 8, &words[first], (last - first + 1) * 8);
+}
+
+// Free runs straight from the words: O(words + runs)
+void BlockManager::rebuildExtents() {
+    free_by_offset.clear();
+    free_by_size.clear();
+    for (uint64_t i = nextFree(0, total_blocks); i < total_blocks;) {
+        uint64_t j = nextUsed(i, total_blocks);
+        free_by_offset.emplace_hint(free_by_offset.end(), i, j - i);
+        free_by_size.insert({j - i, i});
+        i = nextFree(j, total_blocks);
+    }
+}
+
+// Takes the words by value: the caller's read buffer is moved in, not copied
+void BlockManager::loadBitmap(std::vector<uint64_t> disk_words) {
+    std::lock_guard<std::mutex> lock(mtx);
+    disk_words.resize(words.size(), 0);
+    words = std::move(disk_words);
+    if (total_blocks % 64) words.back() |= ~0ULL << (total_blocks % 64);
+    words[0] |= 1; // Header
+
+    uint64_t used = 0;
+    for (uint64_t w : words) used += __builtin_popcountll(w);
+    used_blocks_count = used - (words.size() * 64 - total_blocks);
+    rebuildExtents();
+}
+
+void BlockManager::setPersistHook(std::function<void(uint64_t, const void*, size_t)> hook) {
+    std::lock_guard<std::mutex> lock(mtx);
+    persist = std::move(hook);
+}
+
+void BlockManager::persistAll(bool skip_zero) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!persist || words.empty()) return;
+    if (!skip_zero) {
+        persist(0, words.data(), words.size() * 8);
+        return;
+    }
+    for (size_t w = 0; w < words.size();) { // Runs of non-zero words
+        if (words[w] == 0) {
+            w++;
+            continue;
+        }
+        size_t e = w + 1;
+        while (e < words.size() && words[e] != 0) e++;
+        persist((uint64_t)w * 8, &words[w], (e - w) * 8);
+        w = e;
+    }
+}
+
+std::vector<uint64_t> BlockManager::getBitmap() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return words;
+}
+
+void BlockManager::setHeld(std::vector<uint64_t> mask) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (std::none_of(mask.begin(), mask.end(), [](uint64_t w) { return w != 0; })) mask.clear();
+    else mask.resize(words.size(), 0);
+    held = std::move(mask);
+}
+
+// Whole words that already match are skipped; differing blocks are handled
+// in runs of the same change
+void BlockManager::resetBitmap(const std::vector<uint64_t>& target) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto want = [&](uint64_t b) { return (b >> 6) < target.size() && ((target[b >> 6] >> (b & 63)) & 1); };
+    auto has = [&](uint64_t b) { return ((words[b >> 6] >> (b & 63)) & 1) != 0; };
+    for (uint64_t b = 1; b < total_blocks;) { // Block 0 is the header
+        size_t w = b >> 6;
+        if ((b & 63) == 0 && w < target.size() && words[w] == target[w]) {
+            b += 64;
+            continue;
+        }
+        if (want(b) == has(b)) {
+            b++;
+            continue;
+        }
+        bool used = want(b);
+        uint64_t e = b + 1;
+        while (e < total_blocks && want(e) == used && has(e) != used) e++;
+        if (used) markUsedLocked(b, e - b);
+        else if (overlapsPinned(b, e - b)) deferred_frees.push_back({b, e - b});
+        else freeBlocksLocked(b, e - b);
+        b = e;
+    }
+}
+
+// --- Free-extent index ---
+void BlockManager::addFreeExtent(uint64_t start, uint64_t length) {
+    // Merge with the run right after...
+    auto next = free_by_offset.find(start + length);
+    if (next != free_by_offset.end()) {
+        length += next->second;
+        free_by_size.erase({next->second, next->first});
+        free_by_offset.erase(next);
+    }
+    // ...and the run right before
+    auto prev = free_by_offset.lower_bound(start);
+    if (prev != free_by_offset.begin()) {
+        --prev;
+        if (prev->first + prev->second == start) {
+            start = prev->first;
+            length += prev->second;
+            free_by_size.erase({prev->second, prev->first});
+            free_by_offset.erase(prev);
+        }
+    }
+    free_by_offset[start] = length;
+    free_by_size.insert({length, start});
+}
+
+void BlockManager::removeFreeExtent(uint64_t start, uint64_t length) {
+    free_by_offset.erase(start);
+    free_by_size.erase({length, start});
+}
+
+void BlockManager::carve(uint64_t start, uint64_t count) {
+    auto it = free_by_offset.upper_bound(start);
+    --it; // The run containing 'start' (caller guarantees one exists)
+    uint64_t run_start = it->first, run_len = it->second;
+    removeFreeExtent(run_start, run_len);
+    if (start > run_start) {
+        free_by_offset[run_start] = start - run_start;
+        free_by_size.insert({start - run_start, run_start});
+    }
+    uint64_t run_end = run_start + run_len;
+    if (start + count < run_end) {
+        free_by_offset[start + count] = run_end - (start + count);
+        free_by_size.insert({run_end - (start + count), start + count});
+    }
+}
+
 // Find N consecutive free blocks
-int BlockManager::allocateBlocks(int count) {
-    if (count <= 0) return -1;
-    
-    int consecutive_found = 0;
-    int start_index = -1;
-
-    for (uint32_t i = 0; i < total_blocks; ++i) {
-        if (!bitmap[i]) { // If block is free
-            if (consecutive_found == 0) start_index = i;
-            consecutive_found++;
-            
-            if (consecutive_found == count) {
-                // Found enough space! Mark them as used.
-                markUsed(start_index, count);
-                return start_index;
-            }
-        } else {
-            // Sequence broken, reset
-            consecutive_found = 0;
-            start_index = -1;
+uint64_t BlockManager::allocateBlocks(uint64_t count) {
+    if (count == 0) return 0;
+    std::lock_guard<std::mutex> lock(mtx);
+
+    uint64_t start_index = 0;
+    if (policy == AllocPolicy::BEST_FIT) {
+        auto it = free_by_size.lower_bound({count, 0});
+        if (it != free_by_size.end()) start_index = it->second;
+    } else {
+        // Wrap-around scan starting at the run that holds the cursor
+        auto from = free_by_offset.upper_bound(next_fit_cursor);
+        if (from != free_by_offset.begin()) --from;
+        for (auto it = from; it != free_by_offset.end() && start_index == 0; ++it) {
+            if (it->second >= count) start_index = std::max(it->first, std::min(next_fit_cursor, it->first + it->second - count));
+        }
+        for (auto it = free_by_offset.begin(); it != from && start_index == 0; ++it) {
+            if (it->second >= count) start_index = it->first;
         }
     }
-    
-    return -1; // Not enough contiguous space found
+    if (start_index == 0) return 0; // Not enough contiguous space found
+
+    markUsedLocked(start_index, count);
+    next_fit_cursor = start_index + count;
+    return start_index;
+}
+
+bool BlockManager::allocateExtents(uint64_t count, std::vector<Extent>& out) {
+    out.clear();
+    if (count == 0) return true;
+    uint64_t start = allocateBlocks(count);
+    if (start != 0) {
+        out.push_back({start, count});
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    if (total_blocks - used_blocks_count < count) return false;
+    while (count > 0) {
+        auto largest = std::prev(free_by_size.end()); // Exists: enough blocks are free
+        uint64_t take = std::min(largest->first, count);
+        uint64_t run_start = largest->second;
+        markUsedLocked(run_start, take);
+        out.push_back({run_start, take});
+        count -= take;
+    }
+    return true;
+}
+
+void BlockManager::freeBlocks(uint64_t start_index, uint64_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (overlapsPinned(start_index, count)) {
+        deferred_frees.push_back({start_index, count});
+        return;
+    }
+    freeBlocksLocked(start_index, count);
 }
 
-void BlockManager::freeBlocks(int start_index, int count) {
-    for (int i = 0; i < count; ++i) {
-        int idx = start_index + i;
-        if (idx < (int)total_blocks && bitmap[idx]) {
-            bitmap[idx] = false;
-            used_blocks_count--;
+// Only blocks that are really used change state, so double frees are harmless
+void BlockManager::freeBlocksLocked(uint64_t start_index, uint64_t count) {
+    if (count == 0 || start_index >= total_blocks) return;
+    uint64_t end = std::min(start_index + count, total_blocks);
+    for (uint64_t i = nextUsed(start_index, end); i < end;) {
+        uint64_t j = nextFree(i, end);
+        if (!held.empty()) {
+            while (i < j && isHeld(i)) i++;   // Held blocks stay used
+            uint64_t k = i;
+            while (k < j && !isHeld(k)) k++;
+            j = k;
         }
+        if (j > i) {
+            setRange(i, j - i, false);
+            used_blocks_count -= (j - i);
+            addFreeExtent(i, j - i);
+        }
+        i = nextUsed(std::max(j, i + 1), end);
+    }
+}
+
+bool BlockManager::extendBlocks(uint64_t start_index, uint64_t count, uint64_t new_count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = free_by_offset.find(start_index + count);
+    if (it == free_by_offset.end() || it->second < new_count - count) return false;
+    markUsedLocked(start_index + count, new_count - count);
+    return true;
+}
+
+void BlockManager::markUsed(uint64_t start_index, uint64_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    markUsedLocked(start_index, count);
+}
+
+void BlockManager::markUsedLocked(uint64_t start_index, uint64_t count) {
+    if (count == 0 || start_index >= total_blocks) return;
+    uint64_t end = std::min(start_index + count, total_blocks);
+    for (uint64_t i = nextFree(start_index, end); i < end;) {
+        uint64_t j = nextUsed(i, end);
+        setRange(i, j - i, true);
+        used_blocks_count += (j - i);
+        carve(i, j - i);
+        i = nextFree(j, end);
     }
 }
 
-void BlockManager::markUsed(int start_index, int count) {
-    for (int i = 0; i < count; ++i) {
-        int idx = start_index + i;
-        if (idx < (int)total_blocks && !bitmap[idx]) {
-            bitmap[idx] = true;
-            used_blocks_count++;
+bool BlockManager::overlapsPinned(uint64_t start_index, uint64_t count) const {
+    for (const Extent& p : pinned) {
+        if (start_index < p.start + p.count && p.start < start_index + count) return true;
+    }
+    return false;
+}
+
+bool BlockManager::isFrozen(uint64_t block) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return isHeld(block) || overlapsPinned(block, 1);
+}
+
+uint64_t BlockManager::firstUsed(uint64_t from, uint64_t limit) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return nextUsed(from, std::min(limit, total_blocks));
+}
+
+void BlockManager::pin(uint64_t start_index, uint64_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    pinned.push_back({start_index, count});
+}
+
+void BlockManager::unpin(uint64_t start_index, uint64_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (auto it = pinned.begin(); it != pinned.end(); ++it) {
+        if (it->start == start_index && it->count == count) {
+            pinned.erase(it);
+            break;
+        }
+    }
+    // Complete any frees that were waiting on this range
+    for (size_t i = 0; i < deferred_frees.size();) {
+        if (!overlapsPinned(deferred_frees[i].start, deferred_frees[i].count)) {
+            freeBlocksLocked(deferred_frees[i].start, deferred_frees[i].count);
+            deferred_frees.erase(deferred_frees.begin() + i);
+        } else {
+            i++;
         }
     }
 }
 
-uint32_t BlockManager::getFreeBlocksCount() const {
+uint64_t BlockManager::getFreeBlocksCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
     return total_blocks - used_blocks_count;
 }
 
-uint32_t BlockManager::getTotalBlocks() const {
+uint64_t BlockManager::getTotalBlocks() const {
     return total_blocks;
-}
\ No newline at end of file
+}
+
+uint64_t BlockManager::getFreeExtentCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return free_by_offset.size();
+}
+
+uint64_t BlockManager::getLargestFreeExtent() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return free_by_size.empty() ? 0 : free_by_size.rbegin()->first;
+}
+
+// ============================================================================
+// 4. Slot Map Implementation (User Table)
+// ============================================================================
+
+void SlotMap::reset(uint32_t slot_count) {
+    slots = slot_count;
+    words.assign((slot_count + 63) / 64, 0);
+    by_name.clear();
+}
+
+void SlotMap::claim(uint32_t slot, const std::string& name) {
+    if (slot >= slots) return;
+    words[slot >> 6] |= (uint64_t)1 << (slot & 63);
+    by_name[name] = slot;
+}
+
+int SlotMap::acquire(const std::string& name) {
+    for (size_t w = 0; w < words.size(); w++) {
+        if (words[w] == ~(uint64_t)0) continue;
+        uint32_t slot = w * 64 + __builtin_ctzll(~words[w]);
+        if (slot >= slots) break;
+        claim(slot, name);
+        return static_cast<int>(slot);
+    }
+    return -1;
+}
+
+int SlotMap::find(const std::string& name) const {
+    auto it = by_name.find(name);
+    return it == by_name.end() ? -1 : static_cast<int>(it->second);
+}
+
+int SlotMap::release(const std::string& name) {
+    auto it = by_name.find(name);
+    if (it == by_name.end()) return -1;
+    uint32_t slot = it->second;
+    words[slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+    by_name.erase(it);
+    return static_cast<int>(slot);
+}
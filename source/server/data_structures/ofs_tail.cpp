@@ -0,0 +1,118 @@
+/**
+ * @file ofs_tail.cpp
+ * @brief Small-file packing: inline/tail layout flags and shared tail blocks
+ * @location source/server/data_structures/ofs_tail.cpp
+ */
+
+#include "../../include/ofs_tail.hpp"
+#include <cstring>
+
+// A 48-bit block number: 32-bit low word at 'lo', 16-bit high part at 'hi'
+static uint64_t getBlock48(const uint8_t* lo, const uint8_t* hi) {
+    uint32_t l;
+    uint16_t h;
+    std::memcpy(&l, lo, sizeof(l));
+    std::memcpy(&h, hi, sizeof(h));
+    return ((uint64_t)h << 32) | l;
+}
+
+static void setBlock48(uint8_t* lo, uint8_t* hi, uint64_t block) {
+    uint32_t l = static_cast<uint32_t>(block);
+    uint16_t h = static_cast<uint16_t>(block >> 32);
+    std::memcpy(lo, &l, sizeof(l));
+    std::memcpy(hi, &h, sizeof(h));
+}
+
+uint64_t firstBlock(const uint8_t* block_map) { return getBlock48(block_map, block_map + 24); }
+uint64_t mapBlock(const uint8_t* block_map) { return getBlock48(block_map + 4, block_map + 26); }
+void setFirstBlock(uint8_t* block_map, uint64_t block) { setBlock48(block_map, block_map + 24, block); }
+void setMapBlock(uint8_t* block_map, uint64_t block) { setBlock48(block_map + 4, block_map + 26, block); }
+
+PackedRef packedRef(const uint8_t* block_map) {
+    PackedRef ref;
+    ref.tail_block = getBlock48(block_map + 8, block_map + 14);
+    ref.fragment = block_map[12];
+    ref.flags = block_map[13];
+    return ref;
+}
+
+void setPackedRef(uint8_t* block_map, const PackedRef& ref) {
+    setBlock48(block_map + 8, block_map + 14, ref.tail_block);
+    block_map[12] = ref.fragment;
+    block_map[13] = ref.flags;
+}
+
+// ============================================================================
+// TAIL STORE
+// ============================================================================
+
+TailStore::TailStore(uint32_t bs, BlockManager* block_manager, ReadFn read, WriteFn write)
+    : block_size(bs), blocks(block_manager), readAt(std::move(read)), writeAt(std::move(write)) {}
+
+void TailStore::setMask(uint64_t block, uint32_t mask) {
+    TailBlockHeader th;
+    std::memcpy(th.magic, "TAIL", 4);
+    th.used = mask;
+    writeAt((uint64_t)block * block_size, &th, sizeof(th));
+    masks[block] = mask;
+    if (mask == ~0u) open.erase(block);
+    else open.insert(block);
+}
+
+// First run of n free fragments in the lowest open block, else a new block
+bool TailStore::allocate(uint32_t len, uint64_t& block, uint8_t& fragment) {
+    uint32_t n = fragmentsFor(len);
+    if (len == 0 || n >= FRAGMENTS) return false;
+    uint32_t run = (1u << n) - 1;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (uint64_t b : open) {
+        uint32_t mask = masks[b];
+        for (uint32_t f = 1; f + n <= FRAGMENTS; f++) {
+            if ((mask >> f) & run) continue;
+            block = b;
+            fragment = static_cast<uint8_t>(f);
+            setMask(b, mask | (run << f));
+            return true;
+        }
+    }
+
+    uint64_t b = blocks->allocateBlocks(1);
+    if (b == 0) return false;
+    block = b;
+    fragment = 1;
+    setMask(block, 1u | (run << 1));
+    return true;
+}
+
+void TailStore::release(uint64_t block, uint8_t fragment, uint32_t len) {
+    uint32_t n = fragmentsFor(len);
+    if (len == 0 || fragment == 0 || fragment + n > FRAGMENTS) return;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = masks.find(block);
+    uint32_t mask;
+    if (it != masks.end()) {
+        mask = it->second;
+    } else {
+        TailBlockHeader th;
+        readAt((uint64_t)block * block_size, &th, sizeof(th));
+        if (std::memcmp(th.magic, "TAIL", 4) != 0) return; // Not a tail block: leave it alone
+        mask = th.used;
+    }
+
+    mask &= ~(((1u << n) - 1) << fragment);
+    if (mask <= 1) {
+        masks.erase(block);
+        open.erase(block);
+        blocks->freeBlocks(block, 1);
+    } else {
+        setMask(block, mask);
+    }
+}
+
+void TailStore::invalidate() {
+    std::lock_guard<std::mutex> lock(mtx);
+    masks.clear();
+    open.clear();
+}
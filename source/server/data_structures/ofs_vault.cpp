@@ -0,0 +1,129 @@
+/**
+ * @file ofs_vault.cpp
+ * @brief Delta Vault: file versions and image snapshots (region at file_state_storage_offset)
+ * @location source/server/data_structures/ofs_vault.cpp
+ */
+
+#include "../../include/ofs_vault.hpp"
+#include <cstring>
+#include <algorithm>
+
+// ============================================================================
+// VERSION TABLE
+// ============================================================================
+
+VersionTable::VersionTable(uint64_t off, uint32_t n, ReadFn read, WriteFn write)
+    : offset(off), slots(n), readAt(std::move(read)), writeAt(std::move(write)) {}
+
+// One bulk read; versions of a file are ordered by their number
+void VersionTable::load() {
+    std::lock_guard<std::mutex> lock(mtx);
+    records.assign(slots, VersionRecord{});
+    if (slots) readAt(offset, records.data(), records.size() * sizeof(VersionRecord));
+    by_inode.clear();
+    free_slots.clear();
+    for (uint32_t i = slots; i-- > 0;) {
+        if (records[i].inode == 0) free_slots.push_back(i); // Lowest slot handed out first
+        else by_inode[records[i].inode].push_back(i);
+    }
+    for (auto& kv : by_inode) {
+        std::sort(kv.second.begin(), kv.second.end(), [this](uint32_t a, uint32_t b) {
+            return records[a].version < records[b].version;
+        });
+    }
+}
+
+void VersionTable::release(uint32_t slot) {
+    uint32_t inode = records[slot].inode;
+    auto it = by_inode.find(inode);
+    if (it != by_inode.end()) {
+        it->second.erase(std::remove(it->second.begin(), it->second.end(), slot), it->second.end());
+        if (it->second.empty()) by_inode.erase(it);
+    }
+    std::memset(&records[slot], 0, sizeof(VersionRecord));
+    writeAt(slotOffset(slot), &records[slot], sizeof(VersionRecord));
+    free_slots.push_back(slot);
+}
+
+std::vector<VersionRecord> VersionTable::archive(VersionRecord rec, uint32_t keep) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<VersionRecord> dropped;
+    if (keep == 0 || slots == 0 || rec.inode == 0) {
+        dropped.push_back(rec);
+        return dropped;
+    }
+
+    auto it = by_inode.find(rec.inode);
+    rec.version = (it == by_inode.end()) ? 1 : records[it->second.back()].version + 1;
+    while (it != by_inode.end() && it->second.size() >= keep) {
+        uint32_t oldest = it->second.front();
+        dropped.push_back(records[oldest]);
+        release(oldest);
+        it = by_inode.find(rec.inode);
+    }
+    if (free_slots.empty()) {
+        // Table full: the oldest version of any file makes room
+        uint32_t victim = 0;
+        for (uint32_t i = 1; i < slots; i++) {
+            if (records[i].archived_time < records[victim].archived_time) victim = i;
+        }
+        dropped.push_back(records[victim]);
+        release(victim);
+    }
+
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    records[slot] = rec;
+    writeAt(slotOffset(slot), &records[slot], sizeof(VersionRecord));
+    by_inode[rec.inode].push_back(slot);
+    return dropped;
+}
+
+std::vector<VersionRecord> VersionTable::list(uint32_t inode) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<VersionRecord> out;
+    auto it = by_inode.find(inode);
+    if (it != by_inode.end()) {
+        for (uint32_t slot : it->second) out.push_back(records[slot]);
+    }
+    return out;
+}
+
+bool VersionTable::take(uint32_t inode, uint32_t version, VersionRecord& out) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = by_inode.find(inode);
+    if (it == by_inode.end()) return false;
+    for (uint32_t slot : it->second) {
+        if (records[slot].version == version) {
+            out = records[slot];
+            release(slot);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<VersionRecord> VersionTable::prune(uint32_t inode, uint32_t keep) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<VersionRecord> dropped;
+    auto it = by_inode.find(inode);
+    while (it != by_inode.end() && it->second.size() > keep) {
+        uint32_t oldest = it->second.front();
+        dropped.push_back(records[oldest]);
+        release(oldest);
+        it = by_inode.find(inode);
+    }
+    return dropped;
+}
+
+void VersionTable::forEach(const std::function<void(const VersionRecord&)>& fn) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const auto& kv : by_inode) {
+        for (uint32_t slot : kv.second) fn(records[slot]);
+    }
+}
+
+uint32_t VersionTable::getCount() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return slots - free_slots.size();
+}
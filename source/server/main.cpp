@@ -6,6 +6,14 @@
 
 #include "../include/ofs_server.hpp"
 #include <iostream>
+#include <csignal>
+
+// Lets Ctrl+C / SIGTERM stop the server loop and join the worker pool
+static OFSServer* g_server = nullptr;
+
+static void handleSignal(int) {
+    if (g_server) g_server->shutdown();
+}
 
 int main(int argc, char* argv[]) {
     std::cout << "========================================" << std::endl;
@@ -36,9 +44,14 @@ int main(int argc, char* argv[]) {
     }
 
     // 3. Start the Server Loop
-    // This starts the Socket Listener and the FIFO Queue Worker
+    // This starts the Socket Listener and the FIFO Queue Worker pool
+    g_server = &server;
+    std::signal(SIGINT, handleSignal);
+    std::signal(SIGTERM, handleSignal);
+
     std::cout << "[MAIN] System Ready. Starting Server Loop..." << std::endl;
     server.run();
+    g_server = nullptr;
 
     return 0;
 }
\ No newline at end of file